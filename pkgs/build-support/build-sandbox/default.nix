@@ -1,4 +1,4 @@
-{ stdenv, lib, pkg-config, closureInfo, nix_2_3, boost, dash }:
+{ stdenv, lib, pkg-config, closureInfo, nix_2_3, boost, dash, sqlite }:
 
 drv: { paths ? {}, ... }@attrs:
 
@@ -9,12 +9,52 @@ let
   pathsWanted      = paths.wanted      or [];
   # Paths extracted from PATH-like environment variables, eg. LD_LIBRARY_PATH.
   pathsRuntimeVars = paths.runtimeVars or [];
+  # Entries of /etc to mount (relative to /etc) along with the closures of
+  # their store paths, instead of all of /etc and the closure of /etc/static.
+  # The closures are cached per system generation.
+  pathsEtc         = paths.etc         or null;
+  # Files to prefetch into the page cache during the sandbox setup along with
+  # the wrapped program and its libraries, eg. assets needed at startup.
+  pathsReadahead   = paths.readahead   or [];
   # Mount a dash shell in /bin/sh inside the chroot.
   allowBinSh       = attrs.allowBinSh or false;
   # Enable nix builds from within the sandbox.
   # Has to write the full nix store to make the outputs accessible.
-  # TODO: get rid of nix & pkg-config if this is enabled (in the Makefile)
+  # There are no closure queries then, so neither nix nor sqlite is needed.
   fullNixStore = attrs.fullNixStore or false;
+  # Let further launches of the wrapper join the namespaces of a running
+  # instance instead of setting up a new sandbox. Needs a PID namespace.
+  # Launches with different values of the environment variables the mount
+  # tree depends on set up their own sandbox instead, like with templates.
+  sessions = attrs.sessions or false;
+  # Keep the mount tree in a long-lived template process, so that further
+  # launches only need to copy it. Every launch still gets its own PID, UTS
+  # and IPC namespaces, unlike with sessions. Launches with different values
+  # of the environment variables the mount tree depends on, eg. runtime path
+  # variables or XAUTHORITY, set up their own sandbox instead.
+  mountTemplate = attrs.mountTemplate or false;
+  # Serve the store paths of the closure via a FUSE file system mounted at
+  # the store instead of bind-mounting every single one of them.
+  storeView = attrs.storeView or false;
+  # How to query the runtime closures, either via libnix ("nix") or by reading
+  # the Nix database directly ("sqlite"), which doesn't need to load libnix.
+  # If the database can't be opened read-only, eg. because the user can't
+  # access its WAL, the sqlite backend falls back to libnix. The backend is
+  # only loaded if the closure isn't cached already.
+  closureBackend = attrs.closureBackend or "nix";
+  # Above this many store paths in the closure, mount the whole store
+  # read-only instead of every single one of them. This bounds the launch
+  # time for huge closures, but exposes the FULL store to the sandboxed
+  # program, including everything that isn't part of its closure. Disabled
+  # unless set, 0 disables it as well.
+  storeMountThreshold = attrs.storeMountThreshold or null;
+  # Prefetch the wrapped program and its shared libraries in the background
+  # while the sandbox is set up, which hides some of the disk latency of
+  # cold starts. This costs two extra forks for every launch that sets up a
+  # new sandbox, launches joining a session or template skip it.
+  readahead = attrs.readahead or (pathsReadahead != []);
+  useNix = !fullNixStore && closureBackend == "nix";
+  useSqlite = !fullNixStore && closureBackend == "sqlite";
 
   # The mount and user namespaces are needed for this functionality, so these
   # namespaces are always enabled.
@@ -42,7 +82,12 @@ let
     code = "if (!extra_mount(\"${escaped}\", ${reqBool})) return false;";
   in "echo ${lib.escapeShellArg code} >> params.c");
 
-in stdenv.mkDerivation ({
+in assert sessions -> attrs.namespaces.pid or true;
+   assert !(sessions && mountTemplate);
+   assert storeView -> !(fullNixStore || sessions);
+   assert lib.elem closureBackend [ "nix" "sqlite" ];
+
+stdenv.mkDerivation ({
   name = "${drv.name}-sandboxed";
 
   src = ./src;
@@ -54,34 +99,59 @@ in stdenv.mkDerivation ({
   };
 
   configurePhase = ''
-    echo '#include "setup.h"' > params.c
-    echo 'bool setup_app_paths(void) {' >> params.c
+    echo '#include "params.h"' > params.c
+    echo 'const struct app_mount app_mounts[] = {' >> params.c
 
     ${if fullNixStore then ''
       # /nix/var needs to be writable for nix to work inside the sandbox
-      echo 'if (!bind_mount("/nix/var", false, true, true)) return false;' \
-        >> params.c
-      echo 'if (!bind_mount("/nix/store", true, true, true)) return false;' \
-        >> params.c
-
+      echo '{ "/nix/var", MOUNT_RESTRICTED | MOUNT_RESOLVE },' >> params.c
+      echo '{ "/nix/store", APP_STORE_FLAGS },' >> params.c
     '' else ''
-      for dep in $(< "$closureInfo/store-paths"); do
-        echo 'if (!bind_mount("'"$dep"'", true, true, true)) return false;' \
-          >> params.c
-      done
+      LC_ALL=C sort -u "$closureInfo/store-paths" \
+        | sed -e 's/.*/{ "&", APP_STORE_FLAGS },/' >> params.c
     ''}
 
+    echo '};' >> params.c
+    echo 'const size_t app_mount_count =' >> params.c
+    echo '  sizeof app_mounts / sizeof app_mounts[0];' >> params.c
+    echo 'bool setup_app_paths(void) {' >> params.c
+    echo 'if (!add_app_mounts(app_mounts, app_mount_count)) return false;' >> params.c
+
     ${mkExtraMountParams true  pathsRequired}
     ${mkExtraMountParams false pathsWanted}
 
     echo 'return true; }' >> params.c
 
+    ${lib.optionalString (pathsEtc != null) ''
+      echo 'const char *const etc_paths[] = {' >> params.c
+
+      ${lib.concatMapStringsSep "\n" (entry: let
+        escaped = lib.escapeShellArg "\"${lib.escape ["\\" "\""] entry}\",";
+      in "echo ${escaped} >> params.c") pathsEtc}
+
+      echo '};' >> params.c
+      echo 'const size_t etc_path_count =' >> params.c
+      echo '  sizeof etc_paths / sizeof etc_paths[0];' >> params.c
+    ''}
+
+    ${lib.optionalString readahead ''
+      echo 'const char *const readahead_paths[] = {' >> params.c
+
+      ${lib.concatMapStringsSep "\n" (file: let
+        escaped = lib.escapeShellArg "\"${lib.escape ["\\" "\""] file}\",";
+      in "echo ${escaped} >> params.c") pathsReadahead}
+
+      echo '};' >> params.c
+      echo 'const size_t readahead_path_count =' >> params.c
+      echo '  sizeof readahead_paths / sizeof readahead_paths[0];' >> params.c
+    ''}
+
    ${lib.optionalString (!fullNixStore) ''
-      echo 'bool mount_runtime_path_vars(struct query_state *qs) {' >> params.c
+      echo 'bool add_runtime_path_vars(struct query_state *qs) {' >> params.c
 
       ${lib.concatMapStringsSep "\n" (pathvar: let
         escaped = lib.escapeShellArg (lib.escape ["\\" "\""] pathvar);
-        fun = "mount_from_path_var";
+        fun = "add_path_var_roots";
         result = "echo 'if (!${fun}(qs, \"'${escaped}'\")) return false;'";
       in "${result} >> params.c") pathsRuntimeVars}
 
@@ -97,11 +167,25 @@ in stdenv.mkDerivation ({
     done
   '';
 
-  nativeBuildInputs = [ pkg-config ];
+  # The sqlite backend needs libnix as well for its fallback.
+  nativeBuildInputs = lib.optional (useNix || useSqlite) pkg-config;
   # FIXME: Use current Nix after fixing API compatibility.
-  buildInputs = [ boost nix_2_3 ];
-  makeFlags = [ "BINDIR=${drv}/bin" "EXTRA_NS_FLAGS=${extraNamespaceFlags}" ]
+  buildInputs = lib.optionals (useNix || useSqlite) [ boost nix_2_3 ]
+             ++ lib.optional useSqlite sqlite;
+  makeFlags = [ "BINDIR=${drv}/bin" "EXTRA_NS_FLAGS=${extraNamespaceFlags}"
+                "NIX_STORE_DIR=${builtins.storeDir}" ]
            ++ lib.optional allowBinSh "BINSH_EXECUTABLE=${dash}/bin/dash"
-           ++ lib.optional fullNixStore "FULL_NIX_STORE=1";
-
-} // removeAttrs attrs [ "namespaces" "paths" "allowBinSh" ])
+           ++ lib.optional fullNixStore "FULL_NIX_STORE=1"
+           ++ lib.optional sessions "SESSIONS=1"
+           ++ lib.optional mountTemplate "MOUNT_TEMPLATE=1"
+           ++ lib.optional storeView "STORE_VIEW=1"
+           ++ lib.optional useSqlite "QUERY_BACKEND=sqlite"
+           ++ lib.optional (pathsEtc != null) "SELECTIVE_ETC=1"
+           ++ lib.optional readahead "READAHEAD=1"
+           ++ lib.optional (storeMountThreshold != null)
+                "STORE_MOUNT_THRESHOLD=${toString storeMountThreshold}";
+
+} // removeAttrs attrs [
+  "namespaces" "paths" "allowBinSh" "sessions" "mountTemplate" "storeView"
+  "closureBackend" "storeMountThreshold" "readahead"
+])
@@ -0,0 +1,112 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define ARENA_ROUND(size) \
+    (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* Chunks are mapped directly, so they don't end up on the malloc heap and
+   pages that are never touched don't cost anything. Every thread bumps its
+   own chunk, only the list of all chunks is shared. */
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+static pthread_mutex_t chunks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena_chunk *chunks = NULL;
+static __thread char *next = NULL;
+static __thread char *end = NULL;
+
+static void new_chunk(size_t size)
+{
+    struct arena_chunk *chunk;
+    size_t chunksize = ARENA_CHUNK_SIZE;
+
+    while (chunksize < size + sizeof(struct arena_chunk))
+        chunksize *= 2;
+
+    chunk = mmap(NULL, chunksize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+        perror("mmap arena chunk");
+        abort();
+    }
+
+    chunk->size = chunksize;
+
+    pthread_mutex_lock(&chunks_lock);
+    chunk->prev = chunks;
+    chunks = chunk;
+    pthread_mutex_unlock(&chunks_lock);
+
+    next = (char *)(chunk + 1);
+    end = (char *)chunk + chunksize;
+}
+
+void *arena_alloc(size_t size)
+{
+    void *ptr;
+
+    size = ARENA_ROUND(size);
+
+    if ((size_t)(end - next) < size)
+        new_chunk(size);
+
+    ptr = next;
+    next += size;
+    return ptr;
+}
+
+/* Resize the last allocation in place if possible, otherwise copy it. The old
+   space is only reclaimed by arena_release(), so arrays grown this way should
+   grow geometrically. */
+void *arena_grow(void *ptr, size_t oldsize, size_t newsize)
+{
+    void *newptr;
+
+    if (ptr != NULL && (char *)ptr + ARENA_ROUND(oldsize) == next &&
+        (size_t)(end - (char *)ptr) >= ARENA_ROUND(newsize)) {
+        next = (char *)ptr + ARENA_ROUND(newsize);
+        return ptr;
+    }
+
+    newptr = arena_alloc(newsize);
+    if (ptr != NULL)
+        memcpy(newptr, ptr, oldsize);
+    return newptr;
+}
+
+char *arena_strndup(const char *str, size_t len)
+{
+    char *copy = arena_alloc(len + 1);
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_strdup(const char *str)
+{
+    return arena_strndup(str, strlen(str));
+}
+
+/* Must only be called once all other threads that used the arena are gone. */
+void arena_release(void)
+{
+    struct arena_chunk *prev;
+
+    while (chunks != NULL) {
+        prev = chunks->prev;
+        munmap(chunks, chunks->size);
+        chunks = prev;
+    }
+
+    next = end = NULL;
+}
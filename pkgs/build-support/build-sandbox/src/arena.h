@@ -0,0 +1,15 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/* Bump-pointer allocator for everything that lives until the wrapped program
+   is executed. Allocations never fail, running out of memory aborts, and
+   nothing is freed individually, everything is dropped by arena_release(). */
+void *arena_alloc(size_t size);
+void *arena_grow(void *ptr, size_t oldsize, size_t newsize);
+char *arena_strdup(const char *str);
+char *arena_strndup(const char *str, size_t len);
+void arena_release(void);
+
+#endif
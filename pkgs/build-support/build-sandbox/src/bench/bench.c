@@ -0,0 +1,409 @@
+/* Launch latency and microbenchmarks for the sandbox setup.
+ *
+ * Usage: bench FIXTURE_DIR RUNS [CONCURRENCY]
+ *
+ * The fixture is created by mkfixture.sh and this file is compiled together
+ * with the generated params.c, see the "bench" target in the Makefile. We
+ * include setup.c directly, so that we can benchmark its static functions.
+ *
+ * If CONCURRENCY is given, only the latency of that many concurrent launches
+ * is measured, see the "bench-concurrent" target.
+ */
+#include "../setup.c"
+
+#include <stdint.h>
+#include <time.h>
+
+#include "../closure-cache.h"
+
+#define MICRO_SAMPLES 50
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+    uint64_t sa = *(const uint64_t*)a, sb = *(const uint64_t*)b;
+    return sa < sb ? -1 : sa > sb;
+}
+
+static void report(const char *name, const char *unit, uint64_t *samples,
+                   size_t count, double divisor)
+{
+    qsort(samples, count, sizeof(uint64_t), sample_cmp);
+
+    printf("%-20s p50=%.2f%s p95=%.2f%s p99=%.2f%s (%zu samples)\n", name,
+           samples[(count - 1) * 50 / 100] / divisor, unit,
+           samples[(count - 1) * 95 / 100] / divisor, unit,
+           samples[(count - 1) * 99 / 100] / divisor, unit, count);
+}
+
+/* Run the whole setup_sandbox() in a child, so every run starts out with a
+   fresh set of namespaces. */
+static bool bench_launch(size_t runs)
+{
+    uint64_t *samples, start;
+    int status;
+    size_t i;
+    pid_t pid;
+
+    if ((samples = calloc(runs, sizeof(uint64_t))) == NULL) {
+        perror("calloc launch samples");
+        return false;
+    }
+
+    for (i = 0; i < runs; ++i) {
+        start = now_ns();
+
+        if ((pid = fork()) == -1) {
+            perror("fork launch");
+            free(samples);
+            return false;
+        } else if (pid == 0) {
+            _exit(setup_sandbox(NULL) ? 0 : 1);
+        }
+
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            fputs("Sandbox setup failed.\n", stderr);
+            free(samples);
+            return false;
+        }
+
+        samples[i] = now_ns() - start;
+    }
+
+    report("launch", "ms", samples, runs, 1e6);
+    free(samples);
+    return true;
+}
+
+/* Start the given number of launches at once and measure the latency of
+   each of them, to see how much they contend with each other. */
+static bool bench_concurrent(size_t runs, size_t concurrency)
+{
+    uint64_t *samples, start;
+    int barrier[2], results[2], status;
+    size_t i, j, count = 0;
+    bool result = true;
+    char barrier_buf;
+    pid_t pid;
+
+    if ((samples = calloc(runs * concurrency, sizeof(uint64_t))) == NULL) {
+        perror("calloc concurrent samples");
+        return false;
+    }
+
+    if (pipe(results) == -1) {
+        perror("pipe results");
+        free(samples);
+        return false;
+    }
+
+    for (i = 0; i < runs && result; ++i) {
+        if (pipe(barrier) == -1) {
+            perror("pipe barrier");
+            result = false;
+            break;
+        }
+
+        for (j = 0; j < concurrency; ++j) {
+            if ((pid = fork()) == -1) {
+                perror("fork launcher");
+                result = false;
+                break;
+            } else if (pid > 0) {
+                continue;
+            }
+
+            // All launchers start as soon as the barrier is closed.
+            close(barrier[1]);
+            close(results[0]);
+            if (read(barrier[0], &barrier_buf, 1) != 0)
+                _exit(1);
+
+            start = now_ns();
+
+            if ((pid = fork()) == -1)
+                _exit(1);
+            else if (pid == 0)
+                _exit(setup_sandbox(NULL) ? 0 : 1);
+
+            if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0)
+                _exit(1);
+
+            start = now_ns() - start;
+            _exit(write(results[1], &start, sizeof start) == sizeof start
+                  ? 0 : 1);
+        }
+
+        close(barrier[0]);
+        close(barrier[1]);
+
+        while (wait(&status) != -1) {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                result = false;
+        }
+
+        for (; count < (i + 1) * concurrency && result; ++count) {
+            if (read(results[0], &samples[count], sizeof(uint64_t))
+                != sizeof(uint64_t))
+                result = false;
+        }
+    }
+
+    close(results[0]);
+    close(results[1]);
+
+    if (!result)
+        fputs("Sandbox setup failed.\n", stderr);
+    else
+        report("concurrent launch", "ms", samples, count, 1e6);
+
+    free(samples);
+    return result;
+}
+
+static bool bench_replace_env(void)
+{
+    uint64_t samples[MICRO_SAMPLES], start;
+    size_t i, j, ops = 10000;
+    char *result;
+
+    for (i = 0; i < MICRO_SAMPLES; ++i) {
+        start = now_ns();
+        for (j = 0; j < ops; ++j) {
+            if ((result = replace_env("$HOME/.local/$XDG_DATA_HOME/x")) == NULL)
+                return false;
+        }
+        samples[i] = now_ns() - start;
+        arena_release();
+    }
+
+    report("replace_env", "ns", samples, MICRO_SAMPLES, ops);
+    return true;
+}
+
+static bool bench_makedirs(const char *fixture)
+{
+    uint64_t samples[MICRO_SAMPLES], start;
+    size_t i, j, ops = 100;
+    char path[PATH_MAX];
+    int dirfd;
+
+    snprintf(path, PATH_MAX, "%s/scratch", fixture);
+
+    if ((dirfd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    cached_paths = new_path_cache();
+
+    for (i = 0; i < MICRO_SAMPLES; ++i) {
+        start = now_ns();
+        for (j = 0; j < ops; ++j) {
+            snprintf(path, PATH_MAX, "nix/store/%zu-bench/lib/%zu", i, j);
+            if (!makedirs(dirfd, path, true))
+                return false;
+        }
+        samples[i] = now_ns() - start;
+    }
+
+    arena_release();
+    cached_paths = NULL;
+    close(dirfd);
+
+    report("makedirs", "ns", samples, MICRO_SAMPLES, ops);
+    return true;
+}
+
+static bool bench_path_cache(char **paths, size_t count)
+{
+    uint64_t samples[MICRO_SAMPLES], start;
+    path_cache pc;
+    size_t i, j;
+
+    for (i = 0; i < MICRO_SAMPLES; ++i) {
+        start = now_ns();
+        pc = new_path_cache();
+        for (j = 0; j < count; ++j)
+            cache_path(pc, paths[j]);
+        arena_release();
+        samples[i] = now_ns() - start;
+    }
+
+    report("path_cache insert", "ns", samples, MICRO_SAMPLES, count);
+    return true;
+}
+
+static bool bench_closure_cache(char **paths, size_t count)
+{
+    uint64_t samples[MICRO_SAMPLES], start;
+    const char *root = paths[0];
+    struct closure_cache *cc;
+    size_t i, j;
+
+    if ((cc = new_closure_cache(FS_ROOT_DIR, &root, 1)) == NULL)
+        return false;
+
+    for (j = 0; j < count; ++j) {
+        if (!add_cached_path(cc, paths[j])) {
+            free_closure_cache(cc);
+            return false;
+        }
+    }
+
+    if (!commit_closure_cache(cc)) {
+        fputs("Unable to write closure cache.\n", stderr);
+        free_closure_cache(cc);
+        return false;
+    }
+
+    free_closure_cache(cc);
+
+    for (i = 0; i < MICRO_SAMPLES; ++i) {
+        start = now_ns();
+        if ((cc = load_closure_cache(FS_ROOT_DIR, &root, 1)) == NULL) {
+            fputs("Unable to load closure cache.\n", stderr);
+            return false;
+        }
+        for (j = 0; next_cached_path(cc) != NULL; ++j);
+        free_closure_cache(cc);
+        samples[i] = now_ns() - start;
+
+        if (j != count) {
+            fprintf(stderr, "Expected %zu cached paths, got %zu.\n", count, j);
+            return false;
+        }
+    }
+
+    report("closure iteration", "ns", samples, MICRO_SAMPLES, count);
+    return true;
+}
+
+static char **read_store_paths(const char *fixture, size_t *count)
+{
+    char file[PATH_MAX], *line = NULL, **paths = NULL, **newpaths;
+    size_t alloc = 0, linesize = 0;
+    ssize_t len;
+    FILE *fp;
+
+    snprintf(file, PATH_MAX, "%s/store-paths", fixture);
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        fprintf(stderr, "open %s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    *count = 0;
+
+    while ((len = getline(&line, &linesize, fp)) > 0) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        if (*count == alloc) {
+            alloc = alloc == 0 ? 1024 : alloc * 2;
+            if ((newpaths = realloc(paths, alloc * sizeof(char*))) == NULL) {
+                perror("realloc store paths");
+                goto fail;
+            }
+            paths = newpaths;
+        }
+
+        if ((paths[*count] = strdup(line)) == NULL) {
+            perror("strdup store path");
+            goto fail;
+        }
+
+        (*count)++;
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (*count == 0) {
+        fprintf(stderr, "No store paths found in %s.\n", file);
+        free(paths);
+        return NULL;
+    }
+
+    return paths;
+
+fail:
+    while (*count > 0)
+        free(paths[--(*count)]);
+    free(paths);
+    free(line);
+    fclose(fp);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    char home[PATH_MAX], cache[PATH_MAX], runtime[PATH_MAX], **paths;
+    size_t count, runs, concurrency = 0, i;
+    bool result;
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s FIXTURE_DIR RUNS [CONCURRENCY]\n",
+                argv[0]);
+        return 1;
+    }
+
+    if ((runs = strtoul(argv[2], NULL, 10)) == 0) {
+        fputs("The number of runs needs to be positive.\n", stderr);
+        return 1;
+    }
+
+    if (argc == 4 && (concurrency = strtoul(argv[3], NULL, 10)) == 0) {
+        fputs("The concurrency needs to be positive.\n", stderr);
+        return 1;
+    }
+
+    if ((paths = read_store_paths(argv[1], &count)) == NULL)
+        return 1;
+
+    snprintf(home, PATH_MAX, "%s/home", argv[1]);
+    snprintf(cache, PATH_MAX, "%s/cache", argv[1]);
+    snprintf(runtime, PATH_MAX, "%s/run", argv[1]);
+
+    if (mkdir(runtime, 0700) == -1 && errno != EEXIST) {
+        fprintf(stderr, "mkdir %s: %s\n", runtime, strerror(errno));
+        return 1;
+    }
+
+    setenv("HOME", home, 1);
+    setenv("XDG_CACHE_HOME", cache, 1);
+    setenv("XDG_RUNTIME_DIR", runtime, 1);
+    unsetenv("XAUTHORITY");
+    unsetenv("NIX_SANDBOX_TRACE");
+    unsetenv("NIX_SANDBOX_DEBUG_INJECT_DIRS");
+
+    printf("== %zu store paths\n", count);
+    fflush(stdout);
+
+    if (concurrency > 0) {
+        printf("== %zu concurrent launches\n", concurrency);
+        fflush(stdout);
+        result = bench_concurrent(runs, concurrency);
+    } else {
+        result = bench_launch(runs)
+              && bench_replace_env()
+              && bench_makedirs(argv[1])
+              && bench_path_cache(paths, count)
+              && bench_closure_cache(paths, count);
+    }
+
+    for (i = 0; i < count; ++i)
+        free(paths[i]);
+    free(paths);
+
+    return result ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Usage: check-budget.sh BUDGET_FILE BENCH_DIR SMALL_SIZE LARGE_SIZE
+#
+# Counts the syscalls of the sandbox setup for two fixture sizes and checks
+# the number of syscalls per additional store path against the budget.
+set -e
+
+budget="$1"
+dir="$2"
+small="$3"
+large="$4"
+
+for size in "$small" "$large"; do
+    if ! env -i HOME="$dir/$size/home" XDG_CACHE_HOME="$dir/$size/cache" \
+         "$dir/syscount" "$dir/$size/setup-once" > "$dir/$size/syscalls"; then
+        echo "Counting syscalls with $size store paths failed." >&2
+        exit 1
+    fi
+done
+
+awk -v small="$small" -v large="$large" '
+    FILENAME == ARGV[1] && !/^#/ && NF == 2 { budget[$1] = $2; next }
+    FILENAME == ARGV[2] { count_small[$1] = $2; next }
+    FILENAME == ARGV[3] { count_large[$1] = $2; next }
+    END {
+        for (name in count_large) {
+            per_path = (count_large[name] - count_small[name]) \
+                     / (large - small)
+            if (name in budget) {
+                status = per_path > budget[name] ? "FAIL" : "ok"
+                if (status == "FAIL")
+                    failed = 1
+                printf "%-14s %6.2f per path (budget %s) %s\n",
+                       name, per_path, budget[name], status
+            } else if (per_path > 0) {
+                printf "%-14s %6.2f per path (no budget)\n", name, per_path
+            }
+        }
+        exit failed
+    }
+' "$budget" "$dir/$small/syscalls" "$dir/$large/syscalls"
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Usage: mkfixture.sh DIR SIZE
+#
+# Creates a synthetic store with SIZE paths in DIR/store along with a
+# params.c which mounts all of them, similar to what default.nix generates.
+set -e
+
+dir="$1"
+size="$2"
+
+rm -rf "$dir"
+mkdir -p "$dir/store" "$dir/root" "$dir/home/data" "$dir/cache" \
+         "$dir/scratch"
+
+awk -v n="$size" -v store="$dir/store" 'BEGIN {
+    for (i = 0; i < n; ++i)
+        printf "%s/%032d-bench-%d\n", store, i, i
+}' > "$dir/store-paths"
+
+sed -e 's!$!/lib!' "$dir/store-paths" | xargs mkdir -p
+sed -e 's!$!/lib/libbench.so!' "$dir/store-paths" | xargs touch
+
+{
+    echo '#include "params.h"'
+    echo 'const struct app_mount app_mounts[] = {'
+    sed -e 's/.*/{ "&", APP_STORE_FLAGS },/' "$dir/store-paths"
+    echo '};'
+    echo 'const size_t app_mount_count = sizeof app_mounts / sizeof app_mounts[0];'
+    echo 'bool setup_app_paths(void) {'
+    echo 'if (!add_app_mounts(app_mounts, app_mount_count)) return false;'
+    echo 'if (!extra_mount("$HOME/data", true)) return false;'
+    echo 'return true; }'
+} > "$dir/params.c"
@@ -0,0 +1,94 @@
+/* Checks of optimize_mount_plan(), run by the "check" target of the
+   Makefile. Sources are set directly instead of being resolved, so that no
+   fixture is needed. */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../arena.h"
+#include "../mount-plan.h"
+
+#define RESTRICTIVE (MOUNT_RDONLY | MOUNT_RESTRICTED)
+
+static bool failed = false;
+
+static struct mount_plan *plan(const char *const *paths, const int *flags,
+                               size_t count)
+{
+    struct mount_plan *mp = new_mount_plan();
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        add_mount_entry(mp, paths[i], flags[i] | MOUNT_STATIC);
+        mp->entries[i].src = mp->entries[i].path;
+    }
+
+    optimize_mount_plan(mp);
+    return mp;
+}
+
+/* Check that exactly one entry for the path is mounted, with the given
+   flags, or none at all if flags is -1. */
+static void expect(const char *name, struct mount_plan *mp, const char *path,
+                   int flags)
+{
+    const struct mount_entry *mounted = NULL;
+    size_t i, count = 0;
+
+    for (i = 0; i < mp->count; ++i) {
+        if (!mp->entries[i].skip && strcmp(mp->entries[i].src, path) == 0) {
+            mounted = &mp->entries[i];
+            count++;
+        }
+    }
+
+    if (flags == -1 && count == 0)
+        return;
+
+    if (count == 1 && (mounted->flags & RESTRICTIVE) == flags)
+        return;
+
+    fprintf(stderr, "%s: %s is mounted %zu times with flags %d, "
+            "expected flags %d\n", name, path, count,
+            mounted == NULL ? -1 : mounted->flags & RESTRICTIVE, flags);
+    failed = true;
+}
+
+/* Duplicates of the same source are merged with the most restrictive flags,
+   no matter in which order they have been added. */
+static void check_mixed_duplicates(void)
+{
+    const char *paths[] = { "/s/a", "/s/a", "/s/b", "/s/b", "/s/b" };
+    const int flags[] = { 0, MOUNT_RDONLY,
+                          MOUNT_RESTRICTED, 0, MOUNT_RDONLY };
+    struct mount_plan *mp = plan(paths, flags, 5);
+
+    expect("mixed duplicates", mp, "/s/a", MOUNT_RDONLY);
+    expect("mixed duplicates", mp, "/s/b", RESTRICTIVE);
+}
+
+/* A duplicate only counts as covered by its ancestor once it's merged. */
+static void check_covered_duplicates(void)
+{
+    const char *paths[] = { "/s/c/d", "/s/c", "/s/c/d", "/s/e", "/s/e/f" };
+    const int flags[] = { 0, MOUNT_RDONLY, MOUNT_RDONLY, MOUNT_RDONLY, 0 };
+    struct mount_plan *mp = plan(paths, flags, 5);
+
+    expect("covered duplicates", mp, "/s/c", MOUNT_RDONLY);
+    expect("covered duplicates", mp, "/s/c/d", -1);
+    expect("covered duplicates", mp, "/s/e", MOUNT_RDONLY);
+    expect("covered duplicates", mp, "/s/e/f", 0);
+}
+
+int main(void)
+{
+    check_mixed_duplicates();
+    check_covered_duplicates();
+    arena_release();
+
+    if (!failed)
+        puts("mount plan checks passed");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,130 @@
+/* Checks of how the multi-call wrapper finds the program to run, which is
+   run by the "check" target of the Makefile. We include sandbox.c directly
+   with a table of our own, and exec ourselves through renamed links to a
+   wrapper link, like users do with their own links to $out/bin. */
+#define main sandbox_main
+#include "../sandbox.c"
+#undef main
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <limits.h>
+#include <stdbool.h>
+
+const struct program programs[] = {
+    { "alpha", "/nonexistent/alpha" },
+    { "beta", "/nonexistent/beta" },
+};
+const size_t program_count = sizeof programs / sizeof programs[0];
+
+bool setup_sandbox(const char *program)
+{
+    return false;
+}
+
+static bool failed = false;
+
+/* Run ourselves via the given path with a misleading argv[0] and check that
+   the child finds the expected program. */
+static void expect(const char *name, const char *path, const char *expected)
+{
+    char *const argv[] = { "mygame", "--lookup", NULL };
+    int status;
+    pid_t pid;
+
+    if ((pid = fork()) == -1) {
+        perror("program: fork");
+        failed = true;
+        return;
+    } else if (pid == 0) {
+        execv(path, argv);
+        _exit(2);
+    }
+
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != (expected == NULL ? 1 : 0)) {
+        fprintf(stderr, "%s: expected %s\n", name,
+                expected == NULL ? "no program" : expected);
+        failed = true;
+    }
+}
+
+static bool make_link(const char *dir, const char *target, const char *name)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, PATH_MAX, "%s/%s", dir, name);
+
+    if (symlink(target, path) == -1) {
+        fprintf(stderr, "program: symlink %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/program-check.XXXXXX", path[PATH_MAX], self[PATH_MAX];
+    const struct program *program;
+    static const char *const links[] = {
+        "bin/alpha", "bin/beta", "mygame", "nested", "other"
+    };
+    ssize_t len;
+    size_t i;
+
+    // The child reports the program it found via its exit status.
+    if (argc == 2 && strcmp(argv[1], "--lookup") == 0) {
+        program = get_program(argv[0]);
+        return program != NULL && strcmp(program->name, getenv("EXPECTED"))
+               == 0 ? 0 : 1;
+    }
+
+    if ((len = readlink("/proc/self/exe", self, PATH_MAX - 1)) == -1) {
+        perror("program: readlink /proc/self/exe");
+        return EXIT_FAILURE;
+    }
+    self[len] = '\0';
+
+    if (mkdtemp(dir) == NULL) {
+        perror("program: mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    snprintf(path, PATH_MAX, "%s/bin", dir);
+
+    // The layout of $out, with a link of the user next to it.
+    if (mkdir(path, 0755) == -1 ||
+        !make_link(dir, self, "bin/alpha") ||
+        !make_link(dir, self, "bin/beta") ||
+        !make_link(dir, "bin/alpha", "mygame") ||
+        !make_link(dir, "mygame", "nested") ||
+        !make_link(dir, self, "other")) {
+        failed = true;
+    } else {
+        setenv("EXPECTED", "alpha", 1);
+        snprintf(path, PATH_MAX, "%s/bin/alpha", dir);
+        expect("wrapper link", path, "alpha");
+        snprintf(path, PATH_MAX, "%s/mygame", dir);
+        expect("renamed link", path, "alpha");
+        snprintf(path, PATH_MAX, "%s/nested", dir);
+        expect("link to a renamed link", path, "alpha");
+        snprintf(path, PATH_MAX, "%s/other", dir);
+        expect("unrelated link", path, NULL);
+    }
+
+    for (i = 0; i < sizeof links / sizeof links[0]; ++i) {
+        snprintf(path, PATH_MAX, "%s/%s", dir, links[i]);
+        unlink(path);
+    }
+
+    snprintf(path, PATH_MAX, "%s/bin", dir);
+    rmdir(path);
+    rmdir(dir);
+
+    if (!failed)
+        puts("program lookup checks passed");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
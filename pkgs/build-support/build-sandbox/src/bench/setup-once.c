@@ -0,0 +1,10 @@
+/* Run the sandbox setup once and exit afterwards, used to count the syscalls
+   of the setup in the "check" target of the Makefile. */
+#include <stdlib.h>
+
+#include "../setup.h"
+
+int main(void)
+{
+    return setup_sandbox(NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,162 @@
+/* Checks of the SQLite query backend against a Nix database in WAL mode,
+   which we can't write to, like users other than root. It's run by the
+   "check" target of the Makefile with QUERY_BACKEND=sqlite and drops its
+   privileges first if it runs as root.
+
+   The writer keeps the database open without checkpointing, so all of the
+   data is in the WAL. The backend has to either return the complete closure
+   or refuse to open the database, so that libnix is used instead. */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <sqlite3.h>
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../arena.h"
+#include "../query-backend.h"
+
+#define UNPRIVILEGED_ID 65534
+
+static const char *const schema =
+    "PRAGMA journal_mode = WAL;"
+    "PRAGMA wal_autocheckpoint = 0;"
+    "CREATE TABLE ValidPaths (id INTEGER PRIMARY KEY, path TEXT UNIQUE);"
+    "CREATE TABLE Refs (referrer INTEGER, reference INTEGER);"
+    "INSERT INTO ValidPaths VALUES (1, '/nix/store/aaaa-a'),"
+    "  (2, '/nix/store/bbbb-b'), (3, '/nix/store/cccc-c'),"
+    "  (4, '/nix/store/dddd-d');"
+    "INSERT INTO Refs VALUES (1, 2), (2, 3), (3, 2);";
+
+static const char *const expected[] = {
+    "/nix/store/aaaa-a", "/nix/store/bbbb-b", "/nix/store/cccc-c"
+};
+#define EXPECTED_COUNT (sizeof expected / sizeof expected[0])
+
+static size_t found = 0;
+static bool unexpected = false;
+
+static bool add_path(void *data, const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < EXPECTED_COUNT; ++i) {
+        if (strcmp(expected[i], path) == 0) {
+            found++;
+            return true;
+        }
+    }
+
+    fprintf(stderr, "sqlite: unexpected path %s in closure\n", path);
+    unexpected = true;
+    return true;
+}
+
+static int run_query(void)
+{
+    const char *root = expected[0];
+
+    if (getuid() == 0 && (setgid(UNPRIVILEGED_ID) == -1 ||
+                          setuid(UNPRIVILEGED_ID) == -1)) {
+        perror("sqlite: drop privileges");
+        return EXIT_FAILURE;
+    }
+
+    if (!open_backend()) {
+        puts("sqlite checks passed (database refused, libnix is used)");
+        return EXIT_SUCCESS;
+    }
+
+    if (!query_closure(&root, 1, NULL, 0, add_path, NULL)) {
+        fputs("sqlite: query failed after the database was opened\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (unexpected || found != EXPECTED_COUNT) {
+        fprintf(stderr, "sqlite: found %zu of %zu paths of the closure\n",
+                found, EXPECTED_COUNT);
+        return EXIT_FAILURE;
+    }
+
+    puts("sqlite checks passed");
+    return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+    static const char *const suffixes[] = { "", "-wal", "-shm" };
+    char dir[] = "/tmp/sqlite-check.XXXXXX", file[PATH_MAX];
+    int status = EXIT_FAILURE;
+    sqlite3 *writer = NULL;
+    size_t i;
+    pid_t pid;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("sqlite: mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    snprintf(file, PATH_MAX, "%s/db", dir);
+
+    if (chmod(dir, 0755) == -1 || mkdir(file, 0755) == -1) {
+        perror("sqlite: create fixture");
+        return EXIT_FAILURE;
+    }
+
+    snprintf(file, PATH_MAX, "%s/db/db.sqlite", dir);
+
+    if (sqlite3_open(file, &writer) != SQLITE_OK ||
+        sqlite3_exec(writer, schema, NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "sqlite: create database: %s\n",
+                sqlite3_errmsg(writer));
+        goto out;
+    }
+
+    // Nobody but the writer may write to the database and its WAL.
+    for (i = 0; i < sizeof suffixes / sizeof suffixes[0]; ++i) {
+        snprintf(file, PATH_MAX, "%s/db/db.sqlite%s", dir, suffixes[i]);
+        chmod(file, 0444);
+    }
+
+    snprintf(file, PATH_MAX, "%s/db", dir);
+    chmod(file, 0555);
+
+    setenv("NIX_STATE_DIR", dir, 1);
+
+    if ((pid = fork()) == -1) {
+        perror("sqlite: fork");
+        goto out;
+    } else if (pid == 0) {
+        status = run_query();
+        fflush(stdout);
+        _exit(status);
+    }
+
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status))
+        status = EXIT_FAILURE;
+    else
+        status = WEXITSTATUS(status);
+
+out:
+    snprintf(file, PATH_MAX, "%s/db", dir);
+    chmod(file, 0755);
+    sqlite3_close(writer);
+
+    for (i = 0; i < sizeof suffixes / sizeof suffixes[0]; ++i) {
+        snprintf(file, PATH_MAX, "%s/db/db.sqlite%s", dir, suffixes[i]);
+        unlink(file);
+    }
+
+    snprintf(file, PATH_MAX, "%s/db", dir);
+    rmdir(file);
+    rmdir(dir);
+    arena_release();
+    return status;
+}
@@ -0,0 +1,156 @@
+/* Count the syscalls of a program and all of its children via ptrace.
+ *
+ * Usage: syscount PROGRAM [ARGS...]
+ *
+ * Prints one line per syscall with its name and the number of times it has
+ * been called, followed by the total. The exit code is the one of PROGRAM,
+ * unless it made a syscall we don't know the name of.
+ */
+#define _GNU_SOURCE
+
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SYSCALLS 1024
+
+static size_t counts[MAX_SYSCALLS];
+// The last syscall without a name, which would escape any budget.
+static long long unknown_nr = -1;
+
+#define SYSCALL_NAME(name) [SYS_##name] = #name
+
+/* syscall-names.h is generated from all of the SYS_* macros of the libc, see
+   the Makefile. */
+static const char *syscall_names[MAX_SYSCALLS] = {
+#include "syscall-names.h"
+};
+
+static void count_syscall(pid_t pid)
+{
+    struct __ptrace_syscall_info info;
+
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof info, &info) == -1) {
+        perror("PTRACE_GET_SYSCALL_INFO");
+        return;
+    }
+
+    if (info.op != PTRACE_SYSCALL_INFO_ENTRY)
+        return;
+
+    if (info.entry.nr < MAX_SYSCALLS && syscall_names[info.entry.nr] != NULL)
+        counts[info.entry.nr]++;
+    else
+        unknown_nr = info.entry.nr;
+}
+
+static int trace(pid_t child)
+{
+    int status, sig, exit_code = 1;
+    long options;
+    pid_t pid;
+
+    options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK
+            | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE
+            | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+
+    if (waitpid(child, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        fputs("Child didn't stop after PTRACE_TRACEME.\n", stderr);
+        return 1;
+    }
+
+    if (ptrace(PTRACE_SETOPTIONS, child, 0, options) == -1) {
+        perror("PTRACE_SETOPTIONS");
+        return 1;
+    }
+
+    if (ptrace(PTRACE_SYSCALL, child, 0, 0) == -1) {
+        perror("PTRACE_SYSCALL");
+        return 1;
+    }
+
+    while ((pid = waitpid(-1, &status, __WALL)) != -1) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == child)
+                exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+            continue;
+        }
+
+        sig = WSTOPSIG(status);
+
+        if (sig == (SIGTRAP | 0x80)) {
+            count_syscall(pid);
+            sig = 0;
+        } else if (sig == SIGTRAP && status >> 16 != 0) {
+            // Fork, clone or exec events, new children are traced already.
+            sig = 0;
+        } else if (sig == SIGSTOP) {
+            // Initial stop of a new child.
+            sig = 0;
+        }
+
+        ptrace(PTRACE_SYSCALL, pid, 0, sig);
+    }
+
+    if (errno != ECHILD) {
+        perror("waitpid");
+        return 1;
+    }
+
+    return exit_code;
+}
+
+int main(int argc, char **argv)
+{
+    size_t i, total = 0;
+    int exit_code;
+    pid_t pid;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s PROGRAM [ARGS...]\n", argv[0]);
+        return 1;
+    }
+
+    switch (pid = fork()) {
+        case -1:
+            perror("fork");
+            return 1;
+        case 0:
+            if (ptrace(PTRACE_TRACEME, 0, 0, 0) == -1) {
+                perror("PTRACE_TRACEME");
+                _exit(1);
+            }
+            raise(SIGSTOP);
+            execv(argv[1], argv + 1);
+            fprintf(stderr, "exec %s: %s\n", argv[1], strerror(errno));
+            _exit(1);
+    }
+
+    exit_code = trace(pid);
+
+    for (i = 0; i < MAX_SYSCALLS; ++i) {
+        if (counts[i] == 0)
+            continue;
+
+        printf("%s %zu\n", syscall_names[i], counts[i]);
+        total += counts[i];
+    }
+
+    printf("total %zu\n", total);
+
+    if (unknown_nr != -1) {
+        fprintf(stderr, "Unknown syscall %lld, syscall-names.h is outdated.\n",
+                unknown_nr);
+        return 1;
+    }
+
+    return exit_code;
+}
@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "closure-cache.h"
+
+/* Bump this whenever the on-disk format changes, entries with a different
+   version are treated as cache misses and get overwritten. */
+#define CLOSURE_CACHE_VERSION 3
+
+#define CLOSURE_CACHE_SUBDIR "/build-sandbox/closures/"
+
+/* The file starts with this header, followed by the NUL-terminated scope, the
+   NUL-terminated store paths of the closure roots and the NUL-terminated store
+   paths of the closure. */
+struct closure_cache_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t nroots;
+    uint32_t count;
+    uint32_t size;
+};
+
+struct closure_cache {
+    /* Either the mapped cache file or the buffer we're going to write. */
+    char *data;
+    size_t size;
+    size_t alloc;
+    bool mapped;
+
+    const char *pos;
+    uint32_t nroots;
+    uint32_t count;
+    char file[PATH_MAX];
+};
+
+/* Same as toStorePath() in Nix, but returns false instead of throwing if the
+   path is not inside of the store. */
+static bool to_store_path(const char *path, char *root)
+{
+    size_t storelen = sizeof NIX_STORE_DIR - 1, len;
+    const char *end;
+
+    if (strncmp(path, NIX_STORE_DIR "/", storelen + 1) != 0)
+        return false;
+
+    if (path[storelen + 1] == '\0')
+        return false;
+
+    if ((end = strchr(path + storelen + 1, '/')) == NULL)
+        len = strlen(path);
+    else
+        len = end - path;
+
+    memcpy(root, path, len);
+    root[len] = '\0';
+    return true;
+}
+
+/* Get the store path whose closure needs to be mounted in order to make the
+   given path available. If one of the ancestors is a symlink into the store,
+   we use that one, because the symlink chain needs to be resolvable inside
+   of the sandbox as well (eg. /run/current-system/sw).
+
+   This is done without opening the Nix store, so that we can look up the
+   closure cache before doing any store queries. */
+bool get_store_root(const char *path, char *root)
+{
+    char buf[PATH_MAX], resolved[PATH_MAX];
+    size_t pathlen = strlen(path), pos;
+    struct stat sb;
+
+    if (pathlen >= PATH_MAX) {
+        fprintf(stderr, "Path %s is larger than PATH_MAX.\n", path);
+        return false;
+    }
+
+    /* Paths inside of the store don't need any symlink lookups, because the
+       closure of their store path includes all of the link targets. */
+    if (to_store_path(path, root))
+        return true;
+
+    memcpy(buf, path, pathlen + 1);
+
+    for (pos = 1; pos < pathlen; ++pos) {
+        if (buf[pos] != '/')
+            continue;
+
+        buf[pos] = '\0';
+
+        if (lstat(buf, &sb) == 0 && S_ISLNK(sb.st_mode) &&
+            realpath(buf, resolved) != NULL && to_store_path(resolved, root))
+            return true;
+
+        buf[pos] = '/';
+    }
+
+    if (realpath(path, resolved) == NULL)
+        memcpy(resolved, path, pathlen + 1);
+
+    if (!to_store_path(resolved, root)) {
+        fprintf(stderr, "Path %s is not in the Nix store.\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+/* The file name is the FNV-1a hash of the scope and all the (sorted) roots,
+   both are stored in the file as well to rule out collisions. */
+static bool get_cache_file(const char *scope, const char *const *roots,
+                           size_t nroots, char *file)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    const char *home, *ptr;
+    size_t i;
+    int len;
+
+    for (i = 0; i <= nroots; ++i) {
+        for (ptr = i == 0 ? scope : roots[i - 1]; ; ++ptr) {
+            hash ^= (unsigned char)*ptr;
+            hash *= 0x100000001b3;
+            if (*ptr == '\0')
+                break;
+        }
+    }
+
+    if ((home = getenv("XDG_CACHE_HOME")) != NULL)
+        len = snprintf(file, PATH_MAX, "%s" CLOSURE_CACHE_SUBDIR "%016llx",
+                       home, (unsigned long long)hash);
+    else if ((home = getenv("HOME")) != NULL)
+        len = snprintf(file, PATH_MAX,
+                       "%s/.cache" CLOSURE_CACHE_SUBDIR "%016llx",
+                       home, (unsigned long long)hash);
+    else
+        return false;
+
+    return len > 0 && len < PATH_MAX;
+}
+
+/* Checks whether a path is a top-level store path, so that a tampered cache
+   file can't be used to mount arbitrary paths into the sandbox. */
+static bool is_store_path(const char *path)
+{
+    char root[PATH_MAX];
+
+    if (strlen(path) >= PATH_MAX || !to_store_path(path, root))
+        return false;
+
+    return strcmp(root, path) == 0
+        && strcmp(root + sizeof NIX_STORE_DIR, "..") != 0
+        && strcmp(root + sizeof NIX_STORE_DIR, ".") != 0;
+}
+
+static bool validate_closure_cache(struct closure_cache *cc, const char *scope,
+                                   const char *const *roots, size_t nroots)
+{
+    struct closure_cache_header *hdr = (void*)cc->data;
+    const char *end = cc->data + cc->size, *ptr;
+    uint32_t count = 0;
+    size_t i;
+
+    if (cc->size < sizeof *hdr + 1 || memcmp(hdr->magic, "BSCC", 4) != 0)
+        return false;
+
+    if (hdr->version != CLOSURE_CACHE_VERSION)
+        return false;
+
+    if (hdr->size != cc->size - sizeof *hdr || *(end - 1) != '\0')
+        return false;
+
+    if (hdr->nroots != nroots)
+        return false;
+
+    ptr = cc->data + sizeof *hdr;
+
+    if (strcmp(ptr, scope) != 0)
+        return false;
+
+    for (ptr += strlen(ptr) + 1, i = 0; i < nroots; ++i) {
+        if (ptr >= end || strcmp(ptr, roots[i]) != 0)
+            return false;
+        ptr += strlen(ptr) + 1;
+    }
+
+    cc->pos = ptr;
+
+    for (; ptr < end; ptr += strlen(ptr) + 1) {
+        if (!is_store_path(ptr))
+            return false;
+        count++;
+    }
+
+    return count == hdr->count;
+}
+
+/* Look up the cached closure of the given store paths. As long as the root
+   paths are still in the store, their closure is guaranteed to be valid as
+   well, so we don't need to ask the store about it. */
+struct closure_cache *load_closure_cache(const char *scope,
+                                         const char *const *roots,
+                                         size_t nroots)
+{
+    struct closure_cache *cc;
+    struct stat sb;
+    void *data;
+    size_t i;
+    int fd;
+
+    for (i = 0; i < nroots; ++i) {
+        if (lstat(roots[i], &sb) == -1)
+            return NULL;
+    }
+
+    if ((cc = malloc(sizeof(struct closure_cache))) == NULL) {
+        perror("malloc closure_cache");
+        return NULL;
+    }
+
+    if (!get_cache_file(scope, roots, nroots, cc->file)) {
+        free(cc);
+        return NULL;
+    }
+
+    if ((fd = open(cc->file, O_RDONLY | O_CLOEXEC)) == -1) {
+        free(cc);
+        return NULL;
+    }
+
+    if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+        close(fd);
+        free(cc);
+        return NULL;
+    }
+
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        free(cc);
+        return NULL;
+    }
+
+    cc->data = data;
+    cc->size = sb.st_size;
+    cc->mapped = true;
+
+    if (!validate_closure_cache(cc, scope, roots, nroots)) {
+        free_closure_cache(cc);
+        return NULL;
+    }
+
+    return cc;
+}
+
+const char *next_cached_path(struct closure_cache *cc)
+{
+    const char *result;
+
+    if (cc->pos >= cc->data + cc->size)
+        return NULL;
+
+    result = cc->pos;
+    cc->pos += strlen(result) + 1;
+    return result;
+}
+
+static bool append_data(struct closure_cache *cc, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *newdata;
+
+    if (cc->size + len > cc->alloc) {
+        cc->alloc = (cc->size + len) * 2;
+        if ((newdata = realloc(cc->data, cc->alloc)) == NULL) {
+            perror("realloc closure cache buffer");
+            return false;
+        }
+        cc->data = newdata;
+    }
+
+    memcpy(cc->data + cc->size, str, len);
+    cc->size += len;
+    return true;
+}
+
+struct closure_cache *new_closure_cache(const char *scope,
+                                        const char *const *roots,
+                                        size_t nroots)
+{
+    struct closure_cache *cc;
+    size_t i;
+
+    if ((cc = malloc(sizeof(struct closure_cache))) == NULL) {
+        perror("malloc closure_cache");
+        return NULL;
+    }
+
+    if (!get_cache_file(scope, roots, nroots, cc->file)) {
+        free(cc);
+        return NULL;
+    }
+
+    cc->data = NULL;
+    cc->size = cc->alloc = sizeof(struct closure_cache_header);
+    cc->mapped = false;
+    cc->nroots = nroots;
+    cc->count = 0;
+
+    if ((cc->data = calloc(1, cc->alloc)) == NULL) {
+        perror("calloc closure cache buffer");
+        free(cc);
+        return NULL;
+    }
+
+    if (!append_data(cc, scope)) {
+        free_closure_cache(cc);
+        return NULL;
+    }
+
+    for (i = 0; i < nroots; ++i) {
+        if (!append_data(cc, roots[i])) {
+            free_closure_cache(cc);
+            return NULL;
+        }
+    }
+
+    return cc;
+}
+
+bool add_cached_path(struct closure_cache *cc, const char *path)
+{
+    if (!append_data(cc, path))
+        return false;
+
+    cc->count++;
+    return true;
+}
+
+static bool makedirs_for(char *file)
+{
+    char *sep;
+
+    for (sep = strchr(file + 1, '/'); sep != NULL; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        if (mkdir(file, 0755) == -1 && errno != EEXIST) {
+            *sep = '/';
+            return false;
+        }
+        *sep = '/';
+    }
+
+    return true;
+}
+
+/* Write the cache entry to a temporary file first and rename it afterwards,
+   so that concurrent launches never see a partially written entry. */
+bool commit_closure_cache(struct closure_cache *cc)
+{
+    struct closure_cache_header *hdr = (void*)cc->data;
+    char tmpfile[PATH_MAX];
+    size_t written = 0;
+    ssize_t ret;
+    int fd;
+
+    memcpy(hdr->magic, "BSCC", 4);
+    hdr->version = CLOSURE_CACHE_VERSION;
+    hdr->nroots = cc->nroots;
+    hdr->count = cc->count;
+    hdr->size = cc->size - sizeof *hdr;
+
+    if (!makedirs_for(cc->file))
+        return false;
+
+    if (snprintf(tmpfile, PATH_MAX, "%s.XXXXXX", cc->file) >= PATH_MAX)
+        return false;
+
+    if ((fd = mkstemp(tmpfile)) == -1)
+        return false;
+
+    while (written < cc->size) {
+        if ((ret = write(fd, cc->data + written, cc->size - written)) == -1) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            unlink(tmpfile);
+            return false;
+        }
+        written += ret;
+    }
+
+    close(fd);
+
+    if (rename(tmpfile, cc->file) == -1) {
+        unlink(tmpfile);
+        return false;
+    }
+
+    return true;
+}
+
+void free_closure_cache(struct closure_cache *cc)
+{
+    if (cc->mapped)
+        munmap(cc->data, cc->size);
+    else
+        free(cc->data);
+    free(cc);
+}
@@ -0,0 +1,29 @@
+#ifndef _CLOSURE_CACHE_H
+#define _CLOSURE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef NIX_STORE_DIR
+#define NIX_STORE_DIR "/nix/store"
+#endif
+
+struct closure_cache;
+
+bool get_store_root(const char *path, char *root);
+
+/* The scope identifies the wrapper a cached closure belongs to. */
+struct closure_cache *load_closure_cache(const char *scope,
+                                         const char *const *roots,
+                                         size_t nroots);
+const char *next_cached_path(struct closure_cache *cc);
+
+struct closure_cache *new_closure_cache(const char *scope,
+                                        const char *const *roots,
+                                        size_t nroots);
+bool add_cached_path(struct closure_cache *cc, const char *path);
+bool commit_closure_cache(struct closure_cache *cc);
+
+void free_closure_cache(struct closure_cache *cc);
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "mount-plan.h"
+
+struct mount_plan *new_mount_plan(void)
+{
+    struct mount_plan *mp = arena_alloc(sizeof(struct mount_plan));
+
+    mp->entries = NULL;
+    mp->count = mp->alloc = 0;
+    return mp;
+}
+
+void reserve_mount_plan(struct mount_plan *mp, size_t count)
+{
+    if (count <= mp->alloc)
+        return;
+
+    mp->entries = arena_grow(mp->entries,
+                             mp->alloc * sizeof(struct mount_entry),
+                             count * sizeof(struct mount_entry));
+    mp->alloc = count;
+}
+
+void add_mount_entry(struct mount_plan *mp, const char *path, int flags)
+{
+    struct mount_entry *me;
+
+    if (mp->count == mp->alloc)
+        reserve_mount_plan(mp, mp->alloc == 0 ? 64 : mp->alloc * 2);
+
+    me = &mp->entries[mp->count];
+
+    if (flags & MOUNT_STATIC)
+        me->path = (char *)path;
+    else
+        me->path = arena_strdup(path);
+
+    me->src = NULL;
+    me->links = NULL;
+    me->flags = flags;
+    me->seq = mp->count++;
+    me->is_file = false;
+    me->skip = false;
+}
+
+/* Drop all entries for which the predicate is true, keeping the order of the
+   remaining ones. */
+void remove_mount_entries(struct mount_plan *mp,
+                          bool (*pred)(const struct mount_entry *me))
+{
+    size_t i, j;
+
+    for (i = j = 0; i < mp->count; ++i) {
+        if (!pred(&mp->entries[i]))
+            mp->entries[j++] = mp->entries[i];
+    }
+
+    mp->count = j;
+}
+
+/* Compare paths so that a directory is always directly followed by all of
+   its descendants, eg. "/a" < "/a/b" < "/a-b". */
+static int path_cmp(const char *a, const char *b)
+{
+    unsigned char ca, cb;
+
+    for (;; ++a, ++b) {
+        ca = *a == '/' ? 1 : (unsigned char)*a;
+        cb = *b == '/' ? 1 : (unsigned char)*b;
+
+        if (ca != cb)
+            return ca - cb;
+
+        if (ca == '\0')
+            return 0;
+    }
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct mount_entry *ma = a, *mb = b;
+    int result;
+
+    // Missing sources go to the end, they are never mounted anyway.
+    if (ma->src == NULL || mb->src == NULL) {
+        if (ma->src != mb->src)
+            return ma->src == NULL ? 1 : -1;
+    } else if ((result = path_cmp(ma->src, mb->src)) != 0) {
+        return result;
+    }
+
+    return ma->seq < mb->seq ? -1 : ma->seq > mb->seq;
+}
+
+static bool is_ancestor(const char *ancestor, const char *path)
+{
+    size_t len = strlen(ancestor);
+    return strncmp(ancestor, path, len) == 0 && path[len] == '/';
+}
+
+/* Regular files are always mounted without any further restrictions. */
+static int effective_flags(const struct mount_entry *me)
+{
+    return me->is_file ? 0 : me->flags & (MOUNT_RDONLY | MOUNT_RESTRICTED);
+}
+
+/* Sort the plan by source path, so that parent directories are created and
+   mounted before their children. Afterwards, mark all entries as skipped
+   that are either duplicates or are already covered by a recursive bind
+   mount of one of their ancestors with the same mount flags. Duplicates
+   are mounted once with the most restrictive flags of all of them.
+
+   All of the entries need to have their source paths resolved already. */
+void optimize_mount_plan(struct mount_plan *mp)
+{
+    struct mount_entry **ancestors, *me, *dup;
+    size_t i, next, depth = 0;
+
+    if (mp->count == 0)
+        return;
+
+    qsort(mp->entries, mp->count, sizeof(struct mount_entry), entry_cmp);
+    ancestors = arena_alloc(mp->count * sizeof(struct mount_entry*));
+
+    for (i = 0; i < mp->count; i = next) {
+        me = &mp->entries[i];
+
+        if (me->src == NULL)
+            break;
+
+        for (next = i + 1; next < mp->count; ++next) {
+            dup = &mp->entries[next];
+            if (dup->src == NULL || strcmp(dup->src, me->src) != 0)
+                break;
+
+            me->flags |= dup->flags & (MOUNT_RDONLY | MOUNT_RESTRICTED);
+            dup->skip = true;
+        }
+
+        while (depth > 0 && !is_ancestor(ancestors[depth - 1]->src, me->src))
+            depth--;
+
+        if (depth > 0 &&
+            effective_flags(ancestors[depth - 1]) == effective_flags(me)) {
+            me->skip = true;
+            continue;
+        }
+
+        if (!me->is_file)
+            ancestors[depth++] = me;
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef _MOUNT_PLAN_H
+#define _MOUNT_PLAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MOUNT_RDONLY     (1 << 0)
+#define MOUNT_RESTRICTED (1 << 1)
+#define MOUNT_RESOLVE    (1 << 2)
+#define MOUNT_FILE       (1 << 3)
+/* The path outlives the mount plan, eg. it's in static storage or interned
+   in the arena, and isn't copied. */
+#define MOUNT_STATIC     (1 << 4)
+
+/* A symlink on the way from the requested path to the resolved source. */
+struct mount_link {
+    const char *path;
+    const char *target;
+    struct mount_link *next;
+};
+
+struct mount_entry {
+    /* The path as it was requested and the path we actually mount, which is
+       different from the former if MOUNT_RESOLVE is set. If the source path
+       doesn't exist, src is NULL. */
+    char *path;
+    char *src;
+    /* Symlinks to recreate in the sandbox, only set with MOUNT_RESOLVE. */
+    struct mount_link *links;
+
+    int flags;
+    size_t seq;
+
+    bool is_file;
+    /* Set if the mount is already covered by another entry. */
+    bool skip;
+};
+
+struct mount_plan {
+    struct mount_entry *entries;
+    size_t count;
+    size_t alloc;
+};
+
+struct mount_plan *new_mount_plan(void);
+void reserve_mount_plan(struct mount_plan *mp, size_t count);
+void add_mount_entry(struct mount_plan *mp, const char *path, int flags);
+void remove_mount_entries(struct mount_plan *mp,
+                          bool (*pred)(const struct mount_entry *me));
+void optimize_mount_plan(struct mount_plan *mp);
+
+#endif
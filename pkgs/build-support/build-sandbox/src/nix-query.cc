@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
 #if NIX_VERSION >= 112
@@ -12,107 +14,74 @@
 #include <nix/globals.hh>
 #endif
 
+extern "C" {
+#include "query-backend.h"
+}
+
 using namespace nix;
 
-struct query_state {
 #if NIX_VERSION >= 112
-    std::shared_ptr<Store> store;
+static std::shared_ptr<Store> store;
 #else
-    std::shared_ptr<StoreAPI> store;
+static std::shared_ptr<StoreAPI> store;
 #endif
-    PathSet paths;
-    PathSet::iterator iter;
-};
 
-static Path get_store_path(query_state *qs, Path path)
+static void open_store(void)
 {
-    Path canonicalized = canonPath(path, true);
+    if (store)
+        return;
+
 #if NIX_VERSION >= 112
-    return qs->store->toStorePath(canonicalized);
+    store = openStore();
 #else
-    return toStorePath(canonicalized);
+    settings.processEnvironment();
+    settings.loadConfFile();
+    store = openStore(false);
 #endif
 }
 
-static Path get_ancestor(query_state *qs, Path path)
-{
-    size_t pos = 0;
-    std::string tmp;
-
-    while (pos != std::string::npos) {
-        if ((pos = path.find('/', pos + 1)) != std::string::npos) {
-            Path current = path.substr(0, pos);
-
-            if (!isLink(current))
-                continue;
-
-            try {
-                current = get_store_path(qs, current);
-            } catch (...) {
-                continue;
-            }
-
-            return current;
-        }
-    }
-
-    return get_store_path(qs, path);
-}
-
 extern "C" {
-    struct query_state *new_query(void)
+    /* Query backend via libnix, which is loaded by query.c only if the
+     * closure cache misses.
+     *
+     * computeFSClosure() doesn't traverse paths that are already in the
+     * result, so it's seeded with the mounted paths, which are sorted
+     * already and thus inserted in linear time.
+     */
+    bool query_closure(const char *const *roots, size_t nroots,
+                       const char *const *mounted, size_t nmounted,
+                       closure_callback add, void *data)
     {
-        query_state *initial = new query_state();
-#if NIX_VERSION >= 112
-        initial->store = openStore();
-#else
-        settings.processEnvironment();
-        settings.loadConfFile();
-        initial->store = openStore(false);
-#endif
-        return initial;
-    }
-
-    void free_query(query_state *qs)
-    {
-        delete qs;
-    }
-
-    bool query_requisites(query_state *qs, const char *path)
-    {
-        Path query(path);
+        PathSet rootset(roots, roots + nroots);
+        PathSet closure(mounted, mounted + nmounted);
+        auto is_mounted = [&](const Path &path) {
+            return std::binary_search(mounted, mounted + nmounted,
+                                      path.c_str(),
+                                      [](const char *a, const char *b) {
+                                          return strcmp(a, b) < 0;
+                                      });
+        };
 
         try {
-            query = get_ancestor(qs, query);
+            open_store();
 
 #if NIX_VERSION >= 112
-            qs->store->computeFSClosure(
-                qs->store->followLinksToStorePath(query),
-                qs->paths, false, true
-            );
+            store->computeFSClosure(rootset, closure, false, true);
 #else
-            computeFSClosure(
-                *qs->store, followLinksToStorePath(query),
-                qs->paths, false, true
-            );
+            for (const Path &root : rootset)
+                computeFSClosure(*store, root, closure, false, true);
 #endif
         } catch (Error &e) {
-            std::cerr << "Error while querying requisites for "
-                      << query << ": " << e.what()
-                      << std::endl;
+            std::cerr << "Error while querying requisites: "
+                      << e.what() << std::endl;
             return false;
         }
 
-        qs->iter = qs->paths.begin();
+        for (const Path &path : closure) {
+            if (!is_mounted(path) && !add(data, path.c_str()))
+                return false;
+        }
 
         return true;
     }
-
-    const char *next_query_result(query_state *qs)
-    {
-        if (qs->iter == qs->paths.end())
-            return NULL;
-
-        return (qs->iter++)->c_str();
-    }
 }
@@ -2,9 +2,27 @@
 #define _PARAMS_H
 
 #include <stdbool.h>
-#include "nix-query.h"
+#include <stddef.h>
+#include "setup.h"
+
+/* The mount table of the closure of the wrapped program. Without the full
+   store, it only contains store paths, which are sorted with strcmp(). */
+extern const struct app_mount app_mounts[];
+extern const size_t app_mount_count;
+
+#ifdef SELECTIVE_ETC
+/* Entries of /etc, relative to it, which are mounted instead of all of it. */
+extern const char *const etc_paths[];
+extern const size_t etc_path_count;
+#endif
+
+#ifdef SANDBOX_READAHEAD
+/* Files that are prefetched along with the wrapped program, eg. assets. */
+extern const char *const readahead_paths[];
+extern const size_t readahead_path_count;
+#endif
 
 bool setup_app_paths(void);
-bool mount_runtime_path_vars(struct query_state *qs);
+bool add_runtime_path_vars(struct query_state *qs);
 
 #endif
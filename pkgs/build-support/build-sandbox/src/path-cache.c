@@ -0,0 +1,162 @@
+/* A set of paths as an open-addressing hash table with linear probing. The
+   hashes are stored along with the paths, so most mismatches are ruled out
+   without comparing the paths and growing the table doesn't rehash them.
+   The paths are interned in the arena, so the pointers returned by
+   intern_path() stay valid for as long as the arena and can be used instead
+   of copies. */
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "path-cache.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+#define INITIAL_SLOTS 64
+
+struct path_slot {
+    const char *path;
+    uint32_t hash;
+    uint32_t len;
+};
+
+struct path_cache {
+    struct path_slot *slots;
+    size_t mask;
+    size_t count;
+};
+
+/* FNV-1a, which can be computed incrementally for all the prefixes of a path
+   in one go, see cached_prefix(). */
+static uint64_t hash_step(uint64_t hash, unsigned char c)
+{
+    return (hash ^ c) * FNV_PRIME;
+}
+
+static uint32_t hash_finish(uint64_t hash)
+{
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static uint32_t hash_path(const char *path, size_t len)
+{
+    uint64_t hash = FNV_OFFSET;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        hash = hash_step(hash, path[i]);
+
+    return hash_finish(hash);
+}
+
+/* Return the slot of the path, which is empty if it isn't in the set. */
+static struct path_slot *find_slot(const struct path_cache *pc,
+                                   const char *path, size_t len,
+                                   uint32_t hash)
+{
+    struct path_slot *slot;
+    size_t i;
+
+    for (i = hash & pc->mask;; i = (i + 1) & pc->mask) {
+        slot = &pc->slots[i];
+
+        if (slot->path == NULL || (slot->hash == hash && slot->len == len &&
+                                   memcmp(slot->path, path, len) == 0))
+            return slot;
+    }
+}
+
+static struct path_slot *alloc_slots(size_t count)
+{
+    struct path_slot *slots = arena_alloc(count * sizeof(struct path_slot));
+
+    memset(slots, 0, count * sizeof(struct path_slot));
+    return slots;
+}
+
+/* Double the number of slots. The old ones stay in the arena, which at most
+   doubles the memory used by the table. */
+static void grow_slots(struct path_cache *pc)
+{
+    struct path_slot *old = pc->slots;
+    size_t i, oldsize = pc->mask + 1;
+
+    pc->slots = alloc_slots(oldsize * 2);
+    pc->mask = oldsize * 2 - 1;
+
+    for (i = 0; i < oldsize; ++i) {
+        if (old[i].path != NULL)
+            *find_slot(pc, old[i].path, old[i].len, old[i].hash) = old[i];
+    }
+}
+
+path_cache new_path_cache(void)
+{
+    struct path_cache *pc = arena_alloc(sizeof(struct path_cache));
+
+    pc->slots = alloc_slots(INITIAL_SLOTS);
+    pc->mask = INITIAL_SLOTS - 1;
+    pc->count = 0;
+    return pc;
+}
+
+/* Add a path to the set unless it's in there already and return the interned
+   copy of it. *added is set to whether the path is new. */
+const char *intern_path(path_cache pc, const char *path, bool *added)
+{
+    size_t len = strlen(path);
+    uint32_t hash = hash_path(path, len);
+    struct path_slot *slot = find_slot(pc, path, len, hash);
+
+    if ((*added = slot->path == NULL)) {
+        // Keep the load factor at or below 1/2, so the probes stay short.
+        if ((pc->count + 1) * 2 > pc->mask + 1) {
+            grow_slots(pc);
+            slot = find_slot(pc, path, len, hash);
+        }
+
+        slot->path = arena_strndup(path, len);
+        slot->hash = hash;
+        slot->len = len;
+        pc->count++;
+    }
+
+    return slot->path;
+}
+
+/* Returns true if the path is new. */
+bool cache_path(path_cache pc, const char *path)
+{
+    bool added;
+
+    intern_path(pc, path, &added);
+    return added;
+}
+
+bool has_cached_path(path_cache pc, const char *path)
+{
+    size_t len = strlen(path);
+
+    return find_slot(pc, path, len, hash_path(path, len))->path != NULL;
+}
+
+/* Return the length of the longest prefix of the path that is in the set,
+   only counting prefixes that end at a path component, or 0 if there is
+   none. The hashes of all the prefixes are computed in a single pass. */
+size_t cached_prefix(path_cache pc, const char *path)
+{
+    uint64_t hash = FNV_OFFSET;
+    size_t i, found = 0;
+
+    for (i = 0;; ++i) {
+        if (i > 0 && (path[i] == '/' || path[i] == '\0') &&
+            find_slot(pc, path, i, hash_finish(hash))->path != NULL)
+            found = i;
+
+        if (path[i] == '\0')
+            return found;
+
+        hash = hash_step(hash, path[i]);
+    }
+}
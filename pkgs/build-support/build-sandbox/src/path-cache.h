@@ -1,10 +1,15 @@
 #ifndef _PATH_CACHE_H
 #define _PATH_CACHE_H
 
-typedef void *path_cache;
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct path_cache *path_cache;
 
 path_cache new_path_cache(void);
-void free_path_cache(path_cache pc);
+const char *intern_path(path_cache pc, const char *path, bool *added);
 bool cache_path(path_cache pc, const char *path);
+bool has_cached_path(path_cache pc, const char *path);
+size_t cached_prefix(path_cache pc, const char *path);
 
 #endif
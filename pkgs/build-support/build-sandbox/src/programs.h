@@ -0,0 +1,16 @@
+#ifndef _PROGRAMS_H
+#define _PROGRAMS_H
+
+#include <stddef.h>
+
+/* A wrapped program, the table is generated at build time and is sorted by
+   name with strcmp(). */
+struct program {
+    const char *name;
+    const char *path;
+};
+
+extern const struct program programs[];
+extern const size_t program_count;
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _QUERY_BACKEND_H
+#define _QUERY_BACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The query backends are shared objects, which are only loaded by query.c on
+   a closure cache miss. They export a query_closure() function, which
+   calls add() for every path in the combined closure of the given roots.
+
+   The closures of the paths in the sorted "mounted" array are already
+   mounted, so neither they nor their references are traversed or added.
+
+   Backends don't link their own arena or path cache, they use the ones of
+   the wrapper, which exports the functions listed in backend.syms.
+
+   Backends that depend on something that might not be available, eg. read
+   access to the Nix database, also export open_backend(). It's called right
+   after loading and if it fails, the fallback backend is used instead. */
+typedef bool (*closure_callback)(void *data, const char *path);
+typedef bool (*open_backend_fn)(void);
+typedef bool (*query_closure_fn)(const char *const *roots, size_t nroots,
+                                 const char *const *mounted, size_t nmounted,
+                                 closure_callback add, void *data);
+
+bool open_backend(void);
+bool query_closure(const char *const *roots, size_t nroots,
+                   const char *const *mounted, size_t nmounted,
+                   closure_callback add, void *data);
+
+#endif
@@ -0,0 +1,307 @@
+/* Runtime closure queries. Roots are collected and looked up in the closure
+   cache here, the query backend is only loaded if the cache misses, because
+   loading libnix alone takes longer than the rest of the setup. */
+#include <dlfcn.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "closure-cache.h"
+#include "path-cache.h"
+#include "query-backend.h"
+#include "query.h"
+#include "trace.h"
+
+struct query_state {
+    /* Store paths that are mounted anyway, sorted with strcmp(). Their
+       closures are mounted as well, so the traversal stops there. */
+    const char *const *mounted;
+    size_t nmounted;
+
+    // Roots added since the last query.
+    char **roots;
+    size_t nroots;
+    size_t roots_alloc;
+
+    /* All the paths of any closure so far, which are interned, so the same
+       path is never copied twice and the results don't need to be copied. */
+    path_cache known;
+
+    /* All the paths of the current closure and the ones that are new in the
+       current query. */
+    const char **paths;
+    size_t paths_count;
+    size_t paths_alloc;
+    const char **batch;
+    size_t batch_count;
+    size_t batch_alloc;
+    size_t pos;
+};
+
+static void grow(void *ptr, size_t *alloc, size_t needed, size_t elemsize)
+{
+    void **array = ptr;
+    size_t newalloc;
+
+    if (needed <= *alloc)
+        return;
+
+    newalloc = *alloc == 0 ? 256 : *alloc;
+    while (newalloc < needed)
+        newalloc *= 2;
+
+    *array = arena_grow(*array, *alloc * elemsize, newalloc * elemsize);
+    *alloc = newalloc;
+}
+
+/* Add a path of the current closure, which is part of the results if it
+   hasn't been returned by an earlier query. */
+static void add_closure_path(struct query_state *qs, const char *path)
+{
+    bool added;
+
+    path = intern_path(qs->known, path, &added);
+
+    grow(&qs->paths, &qs->paths_alloc, qs->paths_count + 1, sizeof(char*));
+    qs->paths[qs->paths_count++] = path;
+
+    if (added) {
+        grow(&qs->batch, &qs->batch_alloc, qs->batch_count + 1,
+             sizeof(char*));
+        qs->batch[qs->batch_count++] = path;
+    }
+}
+
+static bool add_result(void *data, const char *path)
+{
+    add_closure_path(data, path);
+    return true;
+}
+
+static query_closure_fn open_backend_at(const char *path)
+{
+    query_closure_fn query_closure;
+    open_backend_fn open_backend;
+    void *handle;
+
+    // Never unloaded, the process either execs or exits soon anyway.
+    if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+        fprintf(stderr, "Unable to load query backend: %s\n", dlerror());
+        return NULL;
+    }
+
+    if ((query_closure = (query_closure_fn)dlsym(handle, "query_closure"))
+        == NULL) {
+        fprintf(stderr, "Unable to find query_closure(): %s\n", dlerror());
+        dlclose(handle);
+        return NULL;
+    }
+
+    open_backend = (open_backend_fn)dlsym(handle, "open_backend");
+
+    if (open_backend != NULL && !open_backend()) {
+        dlclose(handle);
+        return NULL;
+    }
+
+    trace_count(TRACE_BACKEND_LOADS, 1);
+    return query_closure;
+}
+
+static query_closure_fn load_backend(void)
+{
+    static query_closure_fn query_closure = NULL;
+
+    if (query_closure != NULL)
+        return query_closure;
+
+    query_closure = open_backend_at(QUERY_BACKEND_PATH);
+
+#ifdef QUERY_FALLBACK_PATH
+    if (query_closure == NULL) {
+        fputs("Falling back to querying closures via libnix.\n", stderr);
+        query_closure = open_backend_at(QUERY_FALLBACK_PATH);
+    }
+#endif
+
+    return query_closure;
+}
+
+static bool compute_closure(struct query_state *qs)
+{
+    query_closure_fn query_closure;
+
+    if ((query_closure = load_backend()) == NULL)
+        return false;
+
+    return query_closure((const char *const *)qs->roots, qs->nroots,
+                         qs->mounted, qs->nmounted, add_result, qs);
+}
+
+static void save_closure(struct query_state *qs, const char *scope,
+                         const char *const *keys, size_t nkeys)
+{
+    struct closure_cache *cc;
+    size_t i;
+
+    // A failure to create the cache entry is not fatal, we just query again.
+    if ((cc = new_closure_cache(scope, keys, nkeys)) == NULL)
+        return;
+
+    for (i = 0; i < qs->paths_count; ++i) {
+        if (!add_cached_path(cc, qs->paths[i])) {
+            free_closure_cache(cc);
+            return;
+        }
+    }
+
+    commit_closure_cache(cc);
+    free_closure_cache(cc);
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+struct query_state *new_query(const char *const *mounted, size_t nmounted)
+{
+    struct query_state *qs = arena_alloc(sizeof(struct query_state));
+
+    memset(qs, 0, sizeof(struct query_state));
+    qs->mounted = mounted;
+    qs->nmounted = nmounted;
+    qs->known = new_path_cache();
+    return qs;
+}
+
+bool add_query_root(struct query_state *qs, const char *path)
+{
+    char root[PATH_MAX];
+    const char *key = root;
+
+    if (!get_store_root(path, root)) {
+        fprintf(stderr, "Unable to get requisites for %s.\n", path);
+        return false;
+    }
+
+    // Its closure is part of the closure of the wrapped program.
+    if (bsearch(&key, qs->mounted, qs->nmounted, sizeof(char*), path_cmp))
+        return true;
+
+    grow(&qs->roots, &qs->roots_alloc, qs->nroots + 1, sizeof(char*));
+    qs->roots[qs->nroots++] = arena_strdup(root);
+    return true;
+}
+
+static bool load_closure(struct query_state *qs, const char *scope,
+                         const char *const *keys, size_t nkeys)
+{
+    struct closure_cache *cc;
+    const char *cached;
+
+    if ((cc = load_closure_cache(scope, keys, nkeys)) == NULL)
+        return false;
+
+    while ((cached = next_cached_path(cc)) != NULL)
+        add_closure_path(qs, cached);
+
+    free_closure_cache(cc);
+    trace_count(TRACE_CLOSURE_CACHE_HITS, 1);
+    return true;
+}
+
+static void dedup_roots(struct query_state *qs)
+{
+    size_t i, j;
+
+    qsort(qs->roots, qs->nroots, sizeof(char*), path_cmp);
+
+    for (i = 1, j = 0; i < qs->nroots; ++i) {
+        if (strcmp(qs->roots[i], qs->roots[j]) != 0)
+            qs->roots[++j] = qs->roots[i];
+    }
+
+    qs->nroots = j + 1;
+}
+
+static void start_query(struct query_state *qs)
+{
+    qs->paths_count = qs->batch_count = qs->pos = 0;
+}
+
+static bool finish_query(struct query_state *qs, bool result)
+{
+    if (!result)
+        fputs("Error while querying requisites.\n", stderr);
+
+    trace_count(TRACE_CLOSURE_PATHS, qs->batch_count);
+    qs->nroots = 0;
+    return result;
+}
+
+/* Compute the closure of all the roots added since the last query in one go,
+   so that paths shared between the roots are only traversed once. The roots
+   are sorted and deduplicated first, which is what the closure cache expects.
+
+   Only paths that haven't been returned by an earlier query are part of the
+   results, so iterating over all queries is linear in the size of the
+   combined closure. */
+bool query_requisites(struct query_state *qs)
+{
+    const char *const *roots = (const char *const *)qs->roots;
+    bool result = true;
+
+    start_query(qs);
+
+    if (qs->nroots == 0)
+        return true;
+
+    dedup_roots(qs);
+
+    if (!load_closure(qs, FS_ROOT_DIR, roots, qs->nroots) &&
+        (result = compute_closure(qs)))
+        save_closure(qs, FS_ROOT_DIR, roots, qs->nroots);
+
+    return finish_query(qs, result);
+}
+
+/* Same as query_requisites(), but the closure is cached as a snapshot under
+   the given store path, which determines the roots. The roots are only added
+   by calling add_roots() if there's no snapshot yet. */
+bool query_snapshot(struct query_state *qs, const char *snapshot,
+                    bool (*add_roots)(struct query_state *qs))
+{
+    bool result = true;
+
+    start_query(qs);
+
+    if (load_closure(qs, FS_ROOT_DIR ":snapshot", &snapshot, 1))
+        return finish_query(qs, true);
+
+    if (!add_roots(qs))
+        return finish_query(qs, false);
+
+    if (qs->nroots > 0) {
+        dedup_roots(qs);
+        result = compute_closure(qs);
+    }
+
+    if (result)
+        save_closure(qs, FS_ROOT_DIR ":snapshot", &snapshot, 1);
+
+    return finish_query(qs, result);
+}
+
+/* The results are interned, so they stay valid as long as the arena does. */
+const char *next_query_result(struct query_state *qs)
+{
+    if (qs->pos >= qs->batch_count)
+        return NULL;
+
+    return qs->batch[qs->pos++];
+}
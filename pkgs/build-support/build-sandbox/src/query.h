@@ -0,0 +1,8 @@
+struct query_state;
+
+struct query_state *new_query(const char *const *mounted, size_t nmounted);
+bool add_query_root(struct query_state *qs, const char *path);
+bool query_requisites(struct query_state *qs);
+bool query_snapshot(struct query_state *qs, const char *snapshot,
+                    bool (*add_roots)(struct query_state *qs));
+const char *next_query_result(struct query_state *qs);
@@ -0,0 +1,299 @@
+/* Prefetch the wrapped program and its shared libraries into the page cache
+   while the sandbox is set up, so the dynamic loader doesn't have to wait
+   for the disk after the exec. The libraries are found the same way as the
+   loader does, via DT_NEEDED and the RPATH/RUNPATH of each object, except
+   for the system defaults and ld.so.cache, which Nix doesn't use. */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "params.h"
+#include "readahead.h"
+
+// Upper bounds for the headers we read, anything larger is not our business.
+#define MAX_PHDRS_SIZE  (64 * 1024)
+#define MAX_DYNAMIC_SIZE (64 * 1024)
+#define MAX_STRTAB_SIZE (1024 * 1024)
+
+#define ELF_NATIVE_CLASS (__ELF_NATIVE_CLASS == 64 ? ELFCLASS64 : ELFCLASS32)
+
+/* All the objects found so far, in the order they are prefetched. The list
+   doubles as the set of visited objects, closures are small enough. */
+struct objects {
+    const char **paths;
+    size_t count;
+    size_t alloc;
+};
+
+static bool is_known(const struct objects *objs, const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < objs->count; ++i) {
+        if (strcmp(objs->paths[i], path) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void add_object(struct objects *objs, const char *path)
+{
+    size_t newalloc;
+
+    if (is_known(objs, path))
+        return;
+
+    if (objs->count == objs->alloc) {
+        newalloc = objs->alloc == 0 ? 64 : objs->alloc * 2;
+        objs->paths = arena_grow(objs->paths, objs->alloc * sizeof(char*),
+                                 newalloc * sizeof(char*));
+        objs->alloc = newalloc;
+    }
+
+    objs->paths[objs->count++] = arena_strdup(path);
+}
+
+static void *read_at(int fd, off_t offset, size_t size)
+{
+    void *buf = arena_alloc(size + 1);
+
+    if (pread(fd, buf, size, offset) != (ssize_t)size)
+        return NULL;
+
+    ((char *)buf)[size] = '\0';
+    return buf;
+}
+
+/* Translate a virtual address into a file offset via the PT_LOAD segment
+   containing it. */
+static bool vaddr_to_offset(const ElfW(Phdr) *phdrs, size_t phnum,
+                            ElfW(Addr) vaddr, off_t *offset)
+{
+    size_t i;
+
+    for (i = 0; i < phnum; ++i) {
+        if (phdrs[i].p_type == PT_LOAD && vaddr >= phdrs[i].p_vaddr &&
+            vaddr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+            *offset = vaddr - phdrs[i].p_vaddr + phdrs[i].p_offset;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Look for a library in a colon-separated list of directories, in which
+   $ORIGIN stands for the directory of the object that needs the library. */
+static bool search_dirs(struct objects *objs, const char *dirs,
+                        const char *origin, const char *name)
+{
+    char path[PATH_MAX];
+    const char *end;
+    size_t len;
+    int n;
+
+    for (; dirs != NULL && *dirs != '\0'; dirs = *end ? end + 1 : end) {
+        end = strchrnul(dirs, ':');
+        len = end - dirs;
+
+        if (strncmp(dirs, "$ORIGIN", 7) == 0)
+            n = snprintf(path, PATH_MAX, "%s%.*s/%s", origin, (int)len - 7,
+                         dirs + 7, name);
+        else if (strncmp(dirs, "${ORIGIN}", 9) == 0)
+            n = snprintf(path, PATH_MAX, "%s%.*s/%s", origin, (int)len - 9,
+                         dirs + 9, name);
+        else
+            n = snprintf(path, PATH_MAX, "%.*s/%s", (int)len, dirs, name);
+
+        if (n < PATH_MAX && access(path, R_OK) == 0) {
+            add_object(objs, path);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void add_needed(struct objects *objs, const char *path,
+                       const char *rpath, const char *runpath,
+                       const char *name)
+{
+    char origin[PATH_MAX];
+    const char *slash;
+
+    if (strchr(name, '/') != NULL) {
+        add_object(objs, name);
+        return;
+    }
+
+    slash = strrchr(path, '/');
+    snprintf(origin, PATH_MAX, "%.*s",
+             slash == NULL ? 1 : (int)(slash - path),
+             slash == NULL ? "." : path);
+
+    // DT_RPATH is ignored by the loader if there is a DT_RUNPATH.
+    if (runpath == NULL && search_dirs(objs, rpath, origin, name))
+        return;
+
+    if (search_dirs(objs, getenv("LD_LIBRARY_PATH"), origin, name))
+        return;
+
+    search_dirs(objs, runpath, origin, name);
+}
+
+/* Add the interpreter and the libraries needed by an ELF object to the list
+   of objects. Anything we don't understand is silently ignored, the loader
+   will complain about it soon enough. */
+static void scan_object(struct objects *objs, int fd, const char *path)
+{
+    const char *interp, *strtab, *rpath = NULL, *runpath = NULL;
+    ElfW(Addr) strtab_addr = 0;
+    ElfW(Phdr) *phdrs;
+    ElfW(Dyn) *dyn = NULL;
+    size_t i, ndyn = 0, strsz = 0;
+    ElfW(Ehdr) ehdr;
+    off_t offset;
+
+    if (pread(fd, &ehdr, sizeof ehdr, 0) != sizeof ehdr ||
+        memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr.e_ident[EI_CLASS] != ELF_NATIVE_CLASS ||
+        ehdr.e_phentsize != sizeof(ElfW(Phdr)) ||
+        ehdr.e_phnum * sizeof(ElfW(Phdr)) > MAX_PHDRS_SIZE)
+        return;
+
+    if ((phdrs = read_at(fd, ehdr.e_phoff,
+                         ehdr.e_phnum * sizeof(ElfW(Phdr)))) == NULL)
+        return;
+
+    for (i = 0; i < ehdr.e_phnum; ++i) {
+        if (phdrs[i].p_type == PT_INTERP && phdrs[i].p_filesz < PATH_MAX) {
+            interp = read_at(fd, phdrs[i].p_offset, phdrs[i].p_filesz);
+            if (interp != NULL)
+                add_object(objs, interp);
+        } else if (phdrs[i].p_type == PT_DYNAMIC &&
+                   phdrs[i].p_filesz <= MAX_DYNAMIC_SIZE) {
+            dyn = read_at(fd, phdrs[i].p_offset, phdrs[i].p_filesz);
+            ndyn = phdrs[i].p_filesz / sizeof(ElfW(Dyn));
+        }
+    }
+
+    if (dyn == NULL)
+        return;
+
+    for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; ++i) {
+        if (dyn[i].d_tag == DT_STRTAB)
+            strtab_addr = dyn[i].d_un.d_ptr;
+        else if (dyn[i].d_tag == DT_STRSZ)
+            strsz = dyn[i].d_un.d_val;
+    }
+
+    if (strsz == 0 || strsz > MAX_STRTAB_SIZE ||
+        !vaddr_to_offset(phdrs, ehdr.e_phnum, strtab_addr, &offset) ||
+        (strtab = read_at(fd, offset, strsz)) == NULL)
+        return;
+
+    for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; ++i) {
+        if (dyn[i].d_tag == DT_RPATH && dyn[i].d_un.d_val < strsz)
+            rpath = strtab + dyn[i].d_un.d_val;
+        else if (dyn[i].d_tag == DT_RUNPATH && dyn[i].d_un.d_val < strsz)
+            runpath = strtab + dyn[i].d_un.d_val;
+    }
+
+    for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; ++i) {
+        if (dyn[i].d_tag == DT_NEEDED && dyn[i].d_un.d_val < strsz)
+            add_needed(objs, path, rpath, runpath,
+                       strtab + dyn[i].d_un.d_val);
+    }
+}
+
+static void prefetch_file(struct objects *objs, const char *path, bool scan)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        readahead(fd, 0, st.st_size);
+
+        if (scan)
+            scan_object(objs, fd, path);
+    }
+
+    close(fd);
+}
+
+static void run_readahead(const char *program)
+{
+    struct objects objs = { NULL, 0, 0 };
+    size_t i;
+
+    // New objects are appended while we go, so this is a breadth-first walk.
+    add_object(&objs, program);
+    for (i = 0; i < objs.count; ++i)
+        prefetch_file(&objs, objs.paths[i], true);
+
+    for (i = 0; i < readahead_path_count; ++i)
+        prefetch_file(&objs, readahead_paths[i], false);
+}
+
+/* The prefetching runs in a detached process, because the sandbox setup
+   needs to be single-threaded to unshare() or setns() into a user namespace.
+   It doesn't keep any of our file descriptors open, so that nobody waits for
+   it to finish, eg. a pipe reading the output of the wrapped program. */
+void start_readahead(const char *program)
+{
+    static bool started = false;
+    int fd, status;
+    pid_t pid;
+
+    // A launch that fails to create a template sets up its own sandbox.
+    if (started || program == NULL)
+        return;
+
+    started = true;
+
+    if ((pid = fork()) == -1) {
+        // Not fatal, the program just starts a bit slower.
+        perror("fork readahead");
+        return;
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return;
+    }
+
+    if (setsid() == -1 || fork() != 0)
+        _exit(EXIT_SUCCESS);
+
+    if ((fd = open("/dev/null", O_RDWR)) != -1) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+
+        if (fd > STDERR_FILENO)
+            close(fd);
+    }
+
+#ifdef SYS_close_range
+    syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0);
+#endif
+
+    run_readahead(program);
+    _exit(EXIT_SUCCESS);
+}
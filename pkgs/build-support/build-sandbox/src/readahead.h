@@ -0,0 +1,6 @@
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+void start_readahead(const char *program);
+
+#endif
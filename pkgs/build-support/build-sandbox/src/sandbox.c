@@ -1,18 +1,108 @@
+#include <sys/auxv.h>
+#include <sys/param.h>
+
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "programs.h"
 #include "setup.h"
 
+static int program_cmp(const void *key, const void *elem)
+{
+    return strcmp(key, ((const struct program *)elem)->name);
+}
+
+static const struct program *find_program(const char *path)
+{
+    const char *name = strrchr(path, '/');
+
+    name = name == NULL ? path : name + 1;
+    return bsearch(name, programs, program_count, sizeof(struct program),
+                   program_cmp);
+}
+
+/* Users might have links of their own to a wrapper with another name, eg.
+   in ~/bin or via symlinkJoin, so follow the links from the path passed to
+   execve() one at a time. The last one is always the wrapper in $out/bin. */
+static const struct program *find_linked_program(const char *execfn)
+{
+    char path[PATH_MAX], target[PATH_MAX];
+    const struct program *program;
+    const char *slash;
+    ssize_t len;
+    int i;
+
+    if (snprintf(path, PATH_MAX, "%s", execfn) >= PATH_MAX)
+        return NULL;
+
+    for (i = 0; i < MAXSYMLINKS; ++i) {
+        if ((len = readlink(path, target, PATH_MAX - 1)) == -1)
+            return NULL;
+
+        target[len] = '\0';
+
+        if ((program = find_program(target)) != NULL)
+            return program;
+
+        // Relative targets are relative to the directory of the link.
+        if (target[0] != '/' && (slash = strrchr(path, '/')) != NULL) {
+            if ((slash - path) + 1 + len >= PATH_MAX)
+                return NULL;
+            memcpy(path + (slash - path) + 1, target, len + 1);
+        } else {
+            memcpy(path, target, len + 1);
+        }
+    }
+
+    return NULL;
+}
+
+/* All wrappers are symlinks to the same binary, so the program to run is
+   determined by the name we've been called with. If argv[0] has been set to
+   something else, the path passed to execve() still has the right name. */
+static const struct program *get_program(const char *argv0)
+{
+    const struct program *program = NULL;
+    const char *execfn;
+
+    if (argv0 != NULL)
+        program = find_program(argv0);
+
+    execfn = (const char *)getauxval(AT_EXECFN);
+
+    if (program == NULL && execfn != NULL)
+        program = find_program(execfn);
+
+    if (program == NULL && execfn != NULL)
+        program = find_linked_program(execfn);
+
+    // No matter how we're called, there's nothing else to run.
+    if (program == NULL && program_count == 1)
+        program = &programs[0];
+
+    return program;
+}
+
 int main(int argc, char **argv)
 {
-    if (!setup_sandbox())
+    const struct program *program;
+
+    if ((program = get_program(argv[0])) == NULL) {
+        fprintf(stderr, "No wrapped program called %s.\n",
+                argv[0] == NULL ? "(null)" : argv[0]);
+        return 1;
+    }
+
+    if (!setup_sandbox(program->path))
         return 1;
 
-    argv[0] = WRAPPED_PROGNAME;
-    if (execv(WRAPPED_PATH, argv) == -1) {
-        fprintf(stderr, "exec %s: %s\n", WRAPPED_PATH, strerror(errno));
+    argv[0] = (char *)program->name;
+    if (execv(program->path, argv) == -1) {
+        fprintf(stderr, "exec %s: %s\n", program->path, strerror(errno));
         return 1;
     }
 
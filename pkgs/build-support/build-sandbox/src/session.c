@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "session.h"
+
+#define SESSION_SUBDIR "/build-sandbox"
+#define TEMPLATE_SUFFIX ".template"
+#define CREATION_SUFFIX ".template.lock"
+#define SESSION_LOCK_SUFFIX ".lock"
+
+static uint64_t fnv1a(uint64_t hash, const char *data, size_t len)
+{
+    for (; len > 0; --len, ++data) {
+        hash ^= (unsigned char)*data;
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+/* All programs of a wrapper share the same mount tree, so the session is
+   identified by the FNV-1a hash of FS_ROOT_DIR, which includes the hash of
+   the wrapper derivation. Templates use the same name with a suffix. */
+static bool get_session_file(char *file, const char *suffix)
+{
+    const char *runtime_dir;
+    uint64_t hash;
+    int len;
+
+    if ((runtime_dir = getenv("XDG_RUNTIME_DIR")) == NULL)
+        return false;
+
+    hash = fnv1a(0xcbf29ce484222325, FS_ROOT_DIR, strlen(FS_ROOT_DIR));
+
+    len = snprintf(file, PATH_MAX, "%s" SESSION_SUBDIR "/%016llx%s",
+                   runtime_dir, (unsigned long long)hash, suffix);
+    return len > 0 && len < PATH_MAX;
+}
+
+static bool make_session_dir(char *file)
+{
+    char *sep = strrchr(file, '/');
+
+    *sep = '\0';
+    if (mkdir(file, 0700) == -1 && errno != EEXIST) {
+        fprintf(stderr, "mkdir %s: %s\n", file, strerror(errno));
+        *sep = '/';
+        return false;
+    }
+    *sep = '/';
+
+    return true;
+}
+
+/* Get the start time of a process, which together with the pid identifies a
+   process even if the pid is reused later. */
+static bool get_start_time(pid_t pid, unsigned long long *start_time)
+{
+    char file[64], buf[1024], *ptr;
+    int fd, field;
+    ssize_t len;
+
+    snprintf(file, sizeof file, "/proc/%ld/stat", (long)pid);
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+        return false;
+
+    len = read(fd, buf, sizeof buf - 1);
+    close(fd);
+
+    if (len <= 0)
+        return false;
+
+    buf[len] = '\0';
+
+    // The command name might contain spaces, so skip it first.
+    if ((ptr = strrchr(buf, ')')) == NULL)
+        return false;
+
+    // The start time is the 22nd field and ptr is at the end of the 2nd one.
+    for (field = 2; field < 22 && ptr != NULL; ++field)
+        ptr = strchr(ptr + 1, ' ');
+
+    if (ptr == NULL)
+        return false;
+
+    *start_time = strtoull(ptr + 1, NULL, 10);
+    return true;
+}
+
+/* Read the holder process from an open session file and return a pidfd for
+   it or -1 if it's gone. If stale is given, it is set if the file belongs
+   to a process that no longer exists. */
+static int open_holder(int fd, bool *stale)
+{
+    unsigned long long expected, start_time;
+    char buf[64];
+    ssize_t len;
+    long pid;
+    int pidfd;
+
+    if ((len = pread(fd, buf, sizeof buf - 1, 0)) <= 0)
+        return -1;
+
+    buf[len] = '\0';
+
+    if (sscanf(buf, "%ld %llu", &pid, &expected) != 2)
+        return -1;
+
+    if ((pidfd = syscall(SYS_pidfd_open, (pid_t)pid, 0)) == -1) {
+        if (stale != NULL && errno == ESRCH)
+            *stale = true;
+        return -1;
+    }
+
+    /* Only check the start time after we have the pidfd, so that the pid
+       can't be reused in between. */
+    if (!get_start_time(pid, &start_time) || start_time != expected) {
+        if (stale != NULL)
+            *stale = true;
+        close(pidfd);
+        return -1;
+    }
+
+    return pidfd;
+}
+
+/* Remove a file unless it has been replaced by another one since we opened
+   it, eg. by a new session. */
+static void unlink_if_same(int fd, const char *file)
+{
+    struct stat sb, current;
+
+    if (fstat(fd, &sb) == 0 && stat(file, &current) == 0 &&
+        sb.st_dev == current.st_dev && sb.st_ino == current.st_ino)
+        unlink(file);
+}
+
+/* Open the lock file of the sessions of this wrapper. The members of a
+   session keep it locked shared, the holder only exits once it can lock it
+   exclusively. */
+int open_session_lock(void)
+{
+    char file[PATH_MAX];
+    int fd;
+
+    if (!get_session_file(file, SESSION_LOCK_SUFFIX) ||
+        !make_session_dir(file))
+        return -1;
+
+    if ((fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+        fprintf(stderr, "open %s: %s\n", file, strerror(errno));
+
+    return fd;
+}
+
+/* Hash the values of the given space-separated environment variables. The
+   null bytes are included, so that unset and empty variables differ. */
+static uint64_t hash_env(const char *names)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    char buf[PIPE_BUF], *name, *value, *saveptr;
+
+    snprintf(buf, sizeof buf, "%s", names);
+
+    for (name = strtok_r(buf, " ", &saveptr); name != NULL;
+         name = strtok_r(NULL, " ", &saveptr)) {
+        hash = fnv1a(hash, name, strlen(name) + 1);
+
+        if ((value = getenv(name)) == NULL) {
+            hash = fnv1a(hash, "", 1);
+        } else {
+            hash = fnv1a(hash, "=", 1);
+            hash = fnv1a(hash, value, strlen(value) + 1);
+        }
+    }
+
+    return hash;
+}
+
+/* Check whether the session or template in the given file was created with
+   the same values of the environment variables it depends on as ours. They
+   are on the second line of the file, after the hash of their values. */
+static bool matches_env(int fd)
+{
+    char buf[PIPE_BUF + 64], *names, *end;
+    unsigned long long hash;
+    ssize_t len;
+
+    if ((len = pread(fd, buf, sizeof buf - 1, 0)) <= 0)
+        return false;
+
+    buf[len] = '\0';
+
+    if ((names = strchr(buf, '\n')) == NULL ||
+        (end = strchr(++names, '\n')) == NULL)
+        return false;
+
+    *end = '\0';
+    hash = strtoull(names, &names, 16);
+    return hash == hash_env(names);
+}
+
+/* Return a pidfd for the holder process of a running session or -1 if there
+   is none. The session lock is held shared and returned in lock_fd, the
+   holder can't exit before it's released. Session files of holders that are
+   gone are removed. If the session depends on other values of the
+   environment than ours, env_differs is set. */
+int open_session(int *lock_fd, bool *env_differs)
+{
+    char file[PATH_MAX];
+    bool stale = false;
+    int fd, pidfd;
+
+    if (!get_session_file(file, ""))
+        return -1;
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+
+    if ((*lock_fd = open_session_lock()) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (flock(*lock_fd, LOCK_SH) == -1 ||
+        (pidfd = open_holder(fd, &stale)) == -1) {
+        if (stale)
+            unlink_if_same(fd, file);
+        close(*lock_fd);
+        close(fd);
+        return -1;
+    }
+
+    if (!matches_env(fd)) {
+        *env_differs = true;
+        close(pidfd);
+        close(*lock_fd);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return pidfd;
+}
+
+/* Return a pidfd for the running template of this wrapper or -1 if there is
+   none. The template file is locked shared and returned in lock_fd, the
+   template only goes away once all of these locks are released. If the
+   template depends on other values of the environment than ours,
+   env_differs is set. */
+int open_template(int *lock_fd, bool *env_differs)
+{
+    char file[PATH_MAX];
+    int fd, pidfd;
+
+    if (!get_session_file(file, TEMPLATE_SUFFIX))
+        return -1;
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+
+    if (flock(fd, LOCK_SH) == -1 || (pidfd = open_holder(fd, NULL)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (!matches_env(fd)) {
+        *env_differs = true;
+        close(pidfd);
+        close(fd);
+        return -1;
+    }
+
+    *lock_fd = fd;
+    return pidfd;
+}
+
+/* Write the session file for the holder process with the given pid and
+   return a descriptor of it. The file is written atomically, so concurrent
+   launches either see the old or the new session. Stale session files are
+   detected via the start time. The hash and the names of the environment
+   variables the sandbox depends on are on the second line. */
+static int write_session_file(char *file, pid_t pid, const char *env_names)
+{
+    char tmpfile[PATH_MAX], buf[PIPE_BUF + 64];
+    unsigned long long start_time;
+    int fd, len;
+
+    if (!get_start_time(pid, &start_time)) {
+        fprintf(stderr, "Unable to get start time of session %ld.\n",
+                (long)pid);
+        return -1;
+    }
+
+    if (!make_session_dir(file))
+        return -1;
+
+    if (snprintf(tmpfile, PATH_MAX, "%s.XXXXXX", file) >= PATH_MAX)
+        return -1;
+
+    if ((fd = mkostemp(tmpfile, O_CLOEXEC)) == -1) {
+        fprintf(stderr, "mkstemp %s: %s\n", tmpfile, strerror(errno));
+        return -1;
+    }
+
+    len = snprintf(buf, sizeof buf, "%ld %llu\n%016llx%s\n", (long)pid,
+                   start_time, (unsigned long long)hash_env(env_names),
+                   env_names);
+
+    if (write(fd, buf, len) != len) {
+        fprintf(stderr, "write %s: %s\n", tmpfile, strerror(errno));
+        close(fd);
+        unlink(tmpfile);
+        return -1;
+    }
+
+    if (rename(tmpfile, file) == -1) {
+        fprintf(stderr, "rename %s: %s\n", tmpfile, strerror(errno));
+        close(fd);
+        unlink(tmpfile);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Publish the holder process with the given pid of a session, which was
+   set up with the given space-separated environment variables. */
+bool publish_session(pid_t pid, const char *env_names)
+{
+    char file[PATH_MAX];
+    int fd;
+
+    if (!get_session_file(file, ""))
+        return true;
+
+    if ((fd = write_session_file(file, pid, env_names)) == -1)
+        return false;
+
+    close(fd);
+    return true;
+}
+
+/* Publish the template process with the given pid, which was set up with
+   the given space-separated environment variables, and return a descriptor
+   of the template file for is_template_idle(). */
+int publish_template(pid_t pid, const char *env_names)
+{
+    char file[PATH_MAX];
+
+    if (!get_session_file(file, TEMPLATE_SUFFIX))
+        return -1;
+
+    return write_session_file(file, pid, env_names);
+}
+
+/* Check whether no launch is using the template anymore. If so, the template
+   file is removed and stays locked until the caller exits, so that launches
+   waiting for the lock don't join a template that is about to go away. */
+bool is_template_idle(int fd)
+{
+    char file[PATH_MAX];
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+        return false;
+
+    // The file might have been replaced by the one of another template.
+    if (get_session_file(file, TEMPLATE_SUFFIX))
+        unlink_if_same(fd, file);
+
+    return true;
+}
+
+/* Serialize the creation of templates, so that concurrent launches don't
+   each create their own template. Returns the descriptor holding the lock or
+   -1 if templates can't be used at all. */
+int lock_template_creation(void)
+{
+    char file[PATH_MAX];
+    int fd;
+
+    if (!get_session_file(file, CREATION_SUFFIX) || !make_session_dir(file))
+        return -1;
+
+    if ((fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+        fprintf(stderr, "open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    if (flock(fd, LOCK_EX) == -1) {
+        fprintf(stderr, "flock %s: %s\n", file, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Check whether there are processes other than the holder in the session's
+   PID namespace. Processes which joined the session are not children of the
+   holder, so we need to look at /proc. */
+bool has_session_members(void)
+{
+    struct dirent *entry;
+    bool result = false;
+    DIR *dir;
+
+    if ((dir = opendir("/proc")) == NULL)
+        return false;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+            continue;
+
+        if (strtol(entry->d_name, NULL, 10) != getpid()) {
+            result = true;
+            break;
+        }
+    }
+
+    closedir(dir);
+    return result;
+}
@@ -0,0 +1,17 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+int open_session_lock(void);
+int open_session(int *lock_fd, bool *env_differs);
+bool publish_session(pid_t pid, const char *env_names);
+bool has_session_members(void);
+
+int open_template(int *lock_fd, bool *env_differs);
+int publish_template(pid_t pid, const char *env_names);
+bool is_template_idle(int fd);
+int lock_template_creation(void);
+
+#endif
@@ -1,28 +1,164 @@
 #define _GNU_SOURCE
 
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <errno.h>
 #include <fcntl.h>
-#include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <linux/sched.h>
+
+#include "arena.h"
+#include "mount-plan.h"
 #include "params.h"
 #include "path-cache.h"
+#include "setup.h"
+#include "trace.h"
+#if defined(SANDBOX_SESSIONS) || defined(SANDBOX_TEMPLATE)
+#include "session.h"
+#endif
+#ifdef SANDBOX_STORE_VIEW
+#include "store-view.h"
+#endif
+#ifdef SANDBOX_READAHEAD
+#include "readahead.h"
+#endif
 #ifndef FULL_NIX_STORE
-#include "nix-query.h"
+#include "query.h"
+#endif
+
+#ifndef NIX_STORE_DIR
+#define NIX_STORE_DIR "/nix/store"
+#endif
+
+/* Above this many store paths, the whole store is mounted instead of every
+   single one of them, which exposes all of the store. Zero, the default,
+   means that they're always mounted one by one. The store view is a single
+   mount anyway, so it doesn't apply there. */
+#ifndef STORE_MOUNT_THRESHOLD
+#define STORE_MOUNT_THRESHOLD 0
+#endif
+
+#ifdef SANDBOX_STORE_VIEW
+#define EXCEEDS_STORE_THRESHOLD(count) false
+#else
+#define EXCEEDS_STORE_THRESHOLD(count) \
+    (STORE_MOUNT_THRESHOLD > 0 && (count) > STORE_MOUNT_THRESHOLD)
 #endif
 
 static path_cache cached_paths = NULL;
+static struct mount_plan *mount_plan = NULL;
+
+#ifdef SANDBOX_STORE_VIEW
+#if defined(FULL_NIX_STORE) || defined(SANDBOX_SESSIONS)
+#error "The store view can't be used with the full store or sessions."
+#endif
+static struct store_view *store_view = NULL;
+/* Socket to the store view server, see fork_store_view(). */
+static int store_view_fd = -1;
+#endif
+
+/* The new mount API is available since glibc 2.36, if the kernel doesn't
+   support it we fall back to plain mount() calls at runtime. */
+#ifdef MOUNT_ATTR_RDONLY
+#define HAVE_NEW_MOUNT_API
+static bool new_mount_api = true;
+#endif
+
+/* clone3() is available since Linux 5.3, if it's not supported we fall back
+   to unshare() and a helper process to write the id maps. */
+#if defined(SYS_clone3) && defined(CLONE_PIDFD)
+#define HAVE_CLONE3
+// P_PIDFD is an enum in glibc 2.36 and missing in older versions.
+#define IDTYPE_PIDFD ((idtype_t)3)
+#endif
+
+#ifdef SANDBOX_SESSIONS
+#if !((EXTRA_NS_FLAGS) & CLONE_NEWPID) || !defined(HAVE_CLONE3)
+#error "Sandbox sessions need a PID namespace and clone3()."
+#endif
+/* The session lock of the holder, see run_session(). */
+static int session_lock_fd = -1;
+#endif
+
+#ifdef SANDBOX_TEMPLATE
+#if defined(SANDBOX_SESSIONS) || !defined(HAVE_CLONE3)
+#error "Sandbox templates need clone3() and can't be used with sessions."
+#endif
+/* How long the template is kept around after the last launch has exited. */
+#define TEMPLATE_IDLE_SECONDS 10
+#endif
+
+#if defined(SANDBOX_SESSIONS) || defined(SANDBOX_TEMPLATE)
+/* The names of the environment variables read while setting up a session
+   or template, which is only used by launches with the same values. They
+   are sent to the process publishing it in a single write to a pipe. */
+static char setup_env[PIPE_BUF - 1];
+static size_t setup_env_len = 0;
+static bool setup_env_overflow = false;
+static pthread_mutex_t setup_env_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool has_setup_env(const char *name, size_t len)
+{
+    const char *ptr;
+
+    for (ptr = setup_env; ptr < setup_env + setup_env_len;
+         ptr += strcspn(ptr + 1, " ") + 1) {
+        if (strncmp(ptr + 1, name, len) == 0 &&
+            (ptr[len + 1] == ' ' || ptr[len + 1] == '\0'))
+            return true;
+    }
+
+    return false;
+}
+
+// Runtime path variables are read on the query thread.
+static void record_setup_env(const char *name)
+{
+    size_t len = strlen(name);
+
+    pthread_mutex_lock(&setup_env_lock);
+
+    if (has_setup_env(name, len)) {
+        pthread_mutex_unlock(&setup_env_lock);
+        return;
+    }
+
+    if (setup_env_len + len + 2 > sizeof setup_env) {
+        setup_env_overflow = true;
+    } else {
+        setup_env[setup_env_len++] = ' ';
+        memcpy(setup_env + setup_env_len, name, len + 1);
+        setup_env_len += len;
+    }
+
+    pthread_mutex_unlock(&setup_env_lock);
+}
+#endif
+
+/* Environment variables that affect the mount tree are read through here,
+   because sessions and templates depend on them. */
+static char *setup_getenv(const char *name)
+{
+#if defined(SANDBOX_SESSIONS) || defined(SANDBOX_TEMPLATE)
+    record_setup_env(name);
+#endif
+    return getenv(name);
+}
 
 static bool write_proc(int proc_pid_fd, const char *fname, const char *buf,
                        size_t buflen, bool ignore_errors)
@@ -61,6 +197,23 @@ static bool write_proc(int proc_pid_fd, const char *fname, const char *buf,
         return false; \
     }
 
+static bool write_idmaps(int proc_pid_fd, uid_t uid, gid_t gid)
+{
+    size_t buflen;
+    char buf[100];
+
+    WRITE_IDMAP("uid_map", uid);
+
+    // Kernels prior to Linux 3.19 which do not impose setgroups()
+    // restrictions won't have this file, so ignore failure.
+    write_proc(proc_pid_fd, "setgroups", "deny", 4, true);
+
+    WRITE_IDMAP("gid_map", gid);
+
+    close(proc_pid_fd);
+    return true;
+}
+
 bool write_maps(pid_t parent_pid)
 {
     int proc_pid_fd;
@@ -81,407 +234,675 @@ bool write_maps(pid_t parent_pid)
         return false;
     }
 
-    WRITE_IDMAP("uid_map", geteuid());
-
-    // Kernels prior to Linux 3.19 which do not impose setgroups()
-    // restrictions won't have this file, so ignore failure.
-    write_proc(proc_pid_fd, "setgroups", "deny", 4, true);
-
-    WRITE_IDMAP("gid_map", getegid());
+    return write_idmaps(proc_pid_fd, geteuid(), getegid());
+}
 
-    return true;
+/* Paths inside of the sandbox are relative to root_fd, so strip the leading
+   slashes of absolute paths. */
+static const char *to_relative(const char *path)
+{
+    while (*path == '/')
+        path++;
+    return path;
 }
 
-static bool makedirs(const char *path, bool do_cache)
+/* Create path and all of its parent directories relative to dirfd.
+
+   If do_cache is true, we look up the deepest directory which has been
+   created before and only create the ones below it. */
+static bool makedirs(int dirfd, const char *path, bool do_cache)
 {
-    char *tmp, *segment;
+    char buf[PATH_MAX];
+    size_t len = strlen(path), pos = 0, i;
 
-    if (*path != '/') {
-        fprintf(stderr, "fatal: Path '%s' is not absolute.\n", path);
+    if (len >= PATH_MAX) {
+        fprintf(stderr, "Path %s is larger than PATH_MAX.\n", path);
         return false;
     }
 
-    if ((tmp = strdup(path)) == NULL) {
-        fprintf(stderr, "strdup of %s: %s\n", path, strerror(errno));
-        return false;
-    }
+    memcpy(buf, path, len + 1);
 
-    segment = dirname(tmp);
+    if (do_cache && (pos = cached_prefix(cached_paths, path)) > 0)
+        trace_count(TRACE_PATH_CACHE_HITS, 1);
 
-    if (!(segment[0] == '/' && segment[1] == '\0')) {
-        if (!makedirs(segment, do_cache)) {
-            free(tmp);
-            return false;
-        }
-    }
+    for (i = pos + 1; i <= len; ++i) {
+        if (buf[i] != '/' && buf[i] != '\0')
+            continue;
 
-    if (!do_cache || cache_path(cached_paths, path))
-        (void)mkdir(path, 0755);
-    free(tmp);
-    return true;
-}
+        buf[i] = '\0';
+        (void)mkdirat(dirfd, buf, 0755);
+        trace_count(TRACE_MKDIRS, 1);
 
-char *get_mount_target(const char *path)
-{
-    size_t pathlen = strlen(path), rootdir_len = strlen(FS_ROOT_DIR);
-    char *target;
+        if (do_cache)
+            cache_path(cached_paths, buf);
 
-    if ((target = malloc(rootdir_len + pathlen + 1)) == NULL) {
-        perror("malloc mount target");
-        return NULL;
+        buf[i] = path[i];
     }
 
-    memcpy(target, FS_ROOT_DIR, rootdir_len);
-    memcpy(target + rootdir_len, path, pathlen + 1);
-    return target;
-}
-
-static bool is_regular_file(const char *path)
-{
-    struct stat st;
-    stat(path, &st);
-    return S_ISREG(st.st_mode);
+    return true;
 }
 
-static bool bind_file(const char *path)
+static bool makeparents(int dirfd, const char *path)
 {
-    char *target, *tmp;
+    char buf[PATH_MAX];
+    const char *sep;
 
-    if (access(path, R_OK) == -1)
-        // Skip missing mount source
+    if ((sep = strrchr(path, '/')) == NULL || sep == path)
         return true;
 
-    if ((target = get_mount_target(path)) == NULL)
-        return false;
-
-    if ((tmp = strdup(target)) == NULL) {
-        perror("strdup bind file target path");
-        free(target);
+    if (sep - path >= PATH_MAX) {
+        fprintf(stderr, "Path %s is larger than PATH_MAX.\n", path);
         return false;
     }
 
-    if (!makedirs(dirname(tmp), true)) {
-        free(target);
-        free(tmp);
-        return false;
-    }
+    memcpy(buf, path, sep - path);
+    buf[sep - path] = '\0';
+    return makedirs(dirfd, buf, true);
+}
 
-    free(tmp);
+/* The tmpfs we're going to chroot into. With the new mount API, the tree
+   stays detached until attach_rootfs() is called right before the chroot. */
+static int root_fd = -1;
+static bool root_attached = false;
 
-    if (!cache_path(cached_paths, path)) {
-        free(target);
+static bool attach_rootfs(void)
+{
+    if (root_attached)
         return true;
-    }
 
-    if (creat(target, 0666) == -1) {
-        fprintf(stderr, "unable to create %s: %s\n", target, strerror(errno));
-        free(target);
+#ifdef HAVE_NEW_MOUNT_API
+    if (move_mount(root_fd, "", AT_FDCWD, FS_ROOT_DIR,
+                   MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+        perror("mount rootfs");
         return false;
     }
+#endif
 
-    if (mount(path, target, "", MS_BIND, NULL) == -1) {
-        fprintf(stderr, "mount file %s to %s: %s\n",
-                path, target, strerror(errno));
-        free(target);
-        return false;
-    }
+    root_attached = true;
+    return true;
+}
 
-    free(target);
+static bool bind_file(const char *path)
+{
+    add_mount_entry(mount_plan, path, MOUNT_FILE);
     return true;
 }
 
-static bool makelinks(const char *from, const char *to)
+#ifdef HAVE_NEW_MOUNT_API
+static bool is_unsupported(int err)
 {
-    char linktarget[PATH_MAX];
-    char *target, *tmp;
-    ssize_t linksize;
-    bool result;
+    return err == ENOSYS || err == EPERM;
+}
+
+/* Attach the mount at fd to the target relative to root_fd. Older kernels
+   don't allow to mount into a detached tree, so if that's the case we attach
+   the root first. */
+static bool attach_mount(int fd, const char *target)
+{
+    int flags = MOVE_MOUNT_F_EMPTY_PATH;
 
-    if (strcmp(from, to) == 0)
+    if (move_mount(fd, "", root_fd, target, flags) == 0)
         return true;
 
-    if ((linksize = readlink(from, linktarget, PATH_MAX)) == -1) {
-        if (errno == EINVAL)
-            // Not a symbolic link
+    if (errno == EINVAL && !root_attached) {
+        if (!attach_rootfs())
+            return false;
+        if (move_mount(fd, "", root_fd, target, flags) == 0)
             return true;
-
-        fprintf(stderr, "reading link %s: %s\n", from, strerror(errno));
-        return false;
     }
 
-    linktarget[linksize] = '\0';
+    return false;
+}
 
-    if ((target = get_mount_target(from)) == NULL)
-        return false;
+/* Clone the mount tree at src, apply all the mount attributes to the clone
+   (including all submounts if recursive is true) and only attach it to
+   target afterwards.
 
-    if ((tmp = strdup(target)) == NULL) {
-        fprintf(stderr, "strdup of %s: %s\n", target, strerror(errno));
-        free(target);
-        return false;
+   If the kernel doesn't support all of the necessary syscalls, false is
+   returned and new_mount_api is set to false. */
+static bool bind_tree(const char *src, const char *target, unsigned int attrs,
+                      bool recursive)
+{
+    struct mount_attr attr = { .attr_set = attrs };
+    unsigned int tflags = OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC;
+    unsigned int sflags = AT_EMPTY_PATH;
+    int fd;
+
+    if (recursive) {
+        tflags |= AT_RECURSIVE;
+        sflags |= AT_RECURSIVE;
     }
 
-    if (!makedirs(dirname(tmp), true)) {
-        free(target);
-        free(tmp);
+    if ((fd = open_tree(AT_FDCWD, src, tflags)) == -1) {
+        if (is_unsupported(errno))
+            new_mount_api = false;
+        else
+            fprintf(stderr, "open_tree %s: %s\n", src, strerror(errno));
         return false;
     }
 
-    free(tmp);
-
-    if (cache_path(cached_paths, target)) {
-        if (symlink(linktarget, target) == -1) {
-            if (errno == EEXIST)
-                goto recurse;
-
-            fprintf(stderr, "creating symlink from %s to %s: %s\n",
-                    target, linktarget, strerror(errno));
-            free(target);
+    if (attrs != 0) {
+        if (mount_setattr(fd, "", sflags, &attr, sizeof attr) == -1) {
+            if (is_unsupported(errno))
+                new_mount_api = false;
+            else
+                fprintf(stderr, "setting mount attributes of %s: %s\n",
+                        src, strerror(errno));
+            close(fd);
             return false;
         }
     }
 
-recurse:
-    result = makelinks(linktarget, to);
-    free(target);
-    return result;
+    if (!attach_mount(fd, target)) {
+        fprintf(stderr, "mount %s to /%s: %s\n", src, target, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+    trace_count(TRACE_MOUNTS, 1);
+    return true;
 }
+#endif
 
-bool bind_mount(const char *path, bool rdonly, bool restricted, bool resolve)
+/* Bind mount src to the target relative to root_fd. The plain mount()
+   syscall only works with absolute paths, so we need an attached root. */
+static bool bind_path(const char *src, const char *target, int flags,
+                      bool recursive)
 {
-    int base_mflags = MS_BIND | MS_REC, mflags = 0;
-    const char *msrc;
-    char src[PATH_MAX], *target;
-
-    if (rdonly)
-        mflags |= MS_RDONLY;
+    int base_mflags = MS_BIND, mflags = 0;
+    char abstarget[PATH_MAX];
 
-    if (restricted)
-        mflags |= MS_NOSUID | MS_NODEV;
+#ifdef HAVE_NEW_MOUNT_API
+    if (new_mount_api) {
+        unsigned int attrs = 0;
+        bool result;
 
-    if (resolve ? realpath(path, src) == NULL : access(path, F_OK) == -1)
-        // Skip missing mount source
-        return true;
+        if (flags & MOUNT_RDONLY)
+            attrs |= MOUNT_ATTR_RDONLY;
 
-    msrc = resolve ? src : path;
+        if (flags & MOUNT_RESTRICTED)
+            attrs |= MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV;
 
-    if (is_regular_file(msrc))
-        return bind_file(msrc);
+        result = bind_tree(src, target, attrs, recursive);
+        if (new_mount_api)
+            return result;
+    }
+#endif
 
-    if ((target = get_mount_target(msrc)) == NULL)
+    if (!attach_rootfs())
         return false;
 
-    if (resolve) {
-        if (!makelinks(path, src)) {
-            free(target);
-            return false;
-        }
-    }
-
-    if (!makedirs(target, false)) {
-        free(target);
+    if (snprintf(abstarget, PATH_MAX, FS_ROOT_DIR "/%s", target) >= PATH_MAX) {
+        fprintf(stderr, "Mount target for %s is too long.\n", src);
         return false;
     }
 
-    if (!cache_path(cached_paths, msrc)) {
-        free(target);
-        return true;
-    }
+    if (recursive)
+        base_mflags |= MS_REC;
+
+    if (flags & MOUNT_RDONLY)
+        mflags |= MS_RDONLY;
+
+    if (flags & MOUNT_RESTRICTED)
+        mflags |= MS_NOSUID | MS_NODEV;
 
-    if (mount(msrc, target, "", base_mflags, NULL) == -1) {
-        fprintf(stderr, "mount %s to %s: %s\n", msrc, target, strerror(errno));
-        free(target);
+    if (mount(src, abstarget, "", base_mflags, NULL) == -1) {
+        fprintf(stderr, "mount %s to %s: %s\n",
+                src, abstarget, strerror(errno));
         return false;
     }
 
     if (mflags != 0) {
         mflags |= base_mflags | MS_REMOUNT;
-        if (mount("none", target, "", mflags, NULL) == -1) {
-            fprintf(stderr, "remount %s: %s\n", target, strerror(errno));
-            free(target);
+        if (mount("none", abstarget, "", mflags, NULL) == -1) {
+            fprintf(stderr, "remount %s: %s\n", abstarget, strerror(errno));
             return false;
         }
     }
 
-    free(target);
+    trace_count(TRACE_MOUNTS, 1);
     return true;
 }
 
-struct envar_offset {
-    int start;
-    int length;
-    int var_start;
-    int var_length;
-    struct envar_offset *next;
-};
-
-static struct envar_offset *alloc_offset(void)
+static bool mount_file(const char *path)
 {
-    struct envar_offset *new_offset;
-    new_offset = malloc(sizeof(struct envar_offset));
+    const char *target = to_relative(path);
 
-    if (new_offset == NULL) {
-        perror("malloc envar_offset");
-        return NULL;
+    if (!makeparents(root_fd, target))
+        return false;
+
+    // Don't truncate the file if the target is within another bind mount.
+    if (mknodat(root_fd, target, S_IFREG | 0644, 0) == -1 && errno != EEXIST) {
+        fprintf(stderr, "unable to create %s: %s\n", path, strerror(errno));
+        return false;
     }
 
-    new_offset->next = NULL;
-    return new_offset;
+    return bind_path(path, target, 0, false);
 }
 
-static struct envar_offset *push_offset(struct envar_offset *current,
-                                        struct envar_offset **base)
+/* Create the symlinks that have been collected for a mount entry while
+   resolving its source. */
+static bool make_links(const struct mount_entry *me)
 {
-    if (current == NULL) {
-        if ((current = alloc_offset()) != NULL)
-            *base = current;
-        return current;
-    }
+    const struct mount_link *link;
+    const char *target;
+
+    for (link = me->links; link != NULL; link = link->next) {
+#ifdef SANDBOX_STORE_VIEW
+        // The symlink is within the store view, so we can't create it ourselves.
+        if (is_store_view_path(link->path)) {
+            if (!allow_store_path(store_view, link->path))
+                return false;
+            continue;
+        }
+#endif
 
-    return current->next = alloc_offset();
-}
+        target = to_relative(link->path);
 
-static void free_offsets(struct envar_offset *base)
-{
-    struct envar_offset *next;
-    if (base == NULL)
-        return;
-    next = base->next;
-    free(base);
-    if (next != NULL)
-        free_offsets(next);
-}
+        if (!makeparents(root_fd, target))
+            return false;
 
-#define MK_XDG_EXPAND(varname, fallback) \
-    if (strcmp(xdg_var, varname) == 0) { \
-        result = malloc(homelen + sizeof fallback); \
-        if (result == NULL) { \
-            perror("malloc " varname); \
-            return NULL; \
-        } \
-        memcpy(result, home, homelen); \
-        memcpy(result + homelen, fallback, sizeof fallback); \
-        return result; \
+        if (cache_path(cached_paths, target)) {
+            if (symlinkat(link->target, root_fd, target) == -1 &&
+                errno != EEXIST) {
+                fprintf(stderr, "creating symlink from %s to %s: %s\n",
+                        link->path, link->target, strerror(errno));
+                return false;
+            }
+            trace_count(TRACE_SYMLINKS, 1);
+        }
     }
 
-static char *expand_xdg_fallback(const char *xdg_var)
+    return true;
+}
+
+/* Add a bind mount to the mount plan, which is executed by
+   execute_mount_plan() after all of the mounts have been collected. */
+bool bind_mount(const char *path, bool rdonly, bool restricted, bool resolve)
 {
-    static char *home = NULL;
-    static size_t homelen;
-    char *result;
+    int flags = 0;
 
-    if (home == NULL) {
-        if ((home = getenv("HOME")) == NULL) {
-            fputs("Unable find $HOME.\n", stderr);
-            return NULL;
-        }
-        homelen = strlen(home);
-    }
+    if (rdonly)
+        flags |= MOUNT_RDONLY;
 
-    MK_XDG_EXPAND("XDG_DATA_HOME", "/.local/share");
-    MK_XDG_EXPAND("XDG_CONFIG_HOME", "/.config");
-    MK_XDG_EXPAND("XDG_CACHE_HOME", "/.cache");
+    if (restricted)
+        flags |= MOUNT_RESTRICTED;
 
-    return NULL;
+    if (resolve)
+        flags |= MOUNT_RESOLVE;
+
+    add_mount_entry(mount_plan, path, flags);
+    return true;
 }
 
-static char *get_offset_var(struct envar_offset *offset, const char *haystack)
+/* Add all the entries of the static mount table to the mount plan. The table
+   lives in .rodata, so the paths don't need to be copied. */
+bool add_app_mounts(const struct app_mount *mounts, size_t count)
 {
-    char *tmp, *result;
+    size_t i;
 
-    tmp = strndup(haystack + offset->var_start, offset->var_length);
+    reserve_mount_plan(mount_plan, mount_plan->count + count);
 
-    if (tmp == NULL) {
-        perror("strndup");
-        return NULL;
-    }
+    for (i = 0; i < count; ++i)
+        add_mount_entry(mount_plan, mounts[i].path,
+                        mounts[i].flags | MOUNT_STATIC);
 
-    result = getenv(tmp);
-    if (result == NULL) {
-        if ((result = expand_xdg_fallback(tmp)) == NULL) {
-            fprintf(stderr, "Unable find variable %s in %s\n", tmp, haystack);
-            free(tmp);
-            return NULL;
-        }
-        free(tmp);
-        return result;
-    }
-    free(tmp);
-    return strdup(result);
+    return true;
 }
 
-static char *replace_env_offset_free(const char *path,
-                                     struct envar_offset *offset)
+static bool mount_dir(const char *src, int flags)
 {
-    struct envar_offset *tmp_offset;
-    size_t buflen, pathlen, varlen, tmplen;
-    int inpos = 0, outpos = 0;
-    char *buf, *curvar;
+    const char *target = to_relative(src);
 
-    buflen = pathlen = strlen(path);
+    if (!makedirs(root_fd, target, true))
+        return false;
 
-    if ((buf = malloc(buflen + 1)) == NULL) {
-        perror("malloc replace_env buffer");
-        return NULL;
-    }
+    return bind_path(src, target, flags, true);
+}
 
-    while (offset != NULL) {
-        if ((curvar = get_offset_var(offset, path)) == NULL) {
-            free(buf);
-            free_offsets(offset);
-            return NULL;
-        }
+/* Collect the chain of symlinks that leads from the requested path to the
+   resolved source, so it can be recreated inside the sandbox. This runs on
+   the resolver threads, so it must not touch any shared state. */
+static bool collect_links(struct mount_entry *me)
+{
+    struct mount_link **tail = &me->links, *link;
+    const char *from = me->path;
+    char linktarget[PATH_MAX];
+    ssize_t linksize;
 
-        varlen = strlen(curvar);
-        tmplen = varlen + (buflen - offset->length);
+    while (strcmp(from, me->src) != 0) {
+        if ((linksize = readlink(from, linktarget, PATH_MAX - 1)) == -1) {
+            if (errno == EINVAL)
+                // Not a symbolic link
+                return true;
 
-        if (tmplen > buflen) {
-            if ((buf = realloc(buf, (buflen = tmplen) + 1)) == NULL) {
-                perror("realloc replace_env buffer");
-                free(buf);
-                free(curvar);
-                free_offsets(offset);
-                return NULL;
-            }
+            fprintf(stderr, "reading link %s: %s\n", from, strerror(errno));
+            return false;
         }
 
-        memcpy(buf + outpos, path + inpos, offset->start - inpos);
-        outpos += offset->start - inpos;
-        inpos = offset->start;
-
-        memcpy(buf + outpos, curvar, varlen);
-        outpos += varlen;
-        inpos += offset->length;
-
-        free(curvar);
+        link = arena_alloc(sizeof(struct mount_link));
+        link->path = from;
+        link->target = arena_strndup(linktarget, linksize);
+        link->next = NULL;
 
-        tmp_offset = offset;
-        offset = offset->next;
-        free(tmp_offset);
+        *tail = link;
+        tail = &link->next;
+        from = link->target;
     }
 
-    memcpy(buf + outpos, path + inpos, pathlen - inpos);
-    *(buf + outpos + (pathlen - inpos)) = '\0';
+    return true;
+}
 
-    return buf;
+/* The store directory with all symlinks resolved, which is the same for all
+   store paths, see resolve_store_path(). It's empty if it can't be resolved
+   or hasn't been yet. */
+static char real_store_dir[PATH_MAX];
+
+static bool is_top_level_store_path(const char *path)
+{
+    return strncmp(path, NIX_STORE_DIR "/", sizeof NIX_STORE_DIR) == 0 &&
+           path[sizeof NIX_STORE_DIR] != '\0' &&
+           strchr(path + sizeof NIX_STORE_DIR, '/') == NULL;
 }
 
-static char *replace_env(const char *path)
+/* Store paths are hardly ever symlinks themselves, so unless they are, only
+   the store directory needs to be resolved instead of calling realpath(),
+   which reads every component of the path. Returns false if the store path
+   needs to be resolved by the caller. */
+static bool resolve_store_path(struct mount_entry *me)
 {
-    int i = 0, start = 0, var_start = 0;
-    size_t pathlen;
-    bool in_var = false, curly = false;
-    struct envar_offset *base = NULL, *offset = NULL;
+    char src[PATH_MAX];
+    struct statx stx;
 
-    pathlen = strlen(path);
+    if (real_store_dir[0] == '\0' || !is_top_level_store_path(me->path))
+        return false;
 
-    while (i < pathlen) {
-        if (path[i] == '$' && !curly && !in_var) {
-            if (i + 1 >= pathlen)
-                break;
+    if (statx(AT_FDCWD, me->path, AT_SYMLINK_NOFOLLOW, STATX_TYPE,
+              &stx) == -1)
+        // Skip missing mount source
+        return true;
 
-            start = i;
+    if (S_ISLNK(stx.stx_mode))
+        return false;
 
-            if (path[i + 1] == '{') {
+    if (strcmp(real_store_dir, NIX_STORE_DIR) == 0) {
+        me->src = me->path;
+    } else if (snprintf(src, PATH_MAX, "%s/%s", real_store_dir,
+                        me->path + sizeof NIX_STORE_DIR) < PATH_MAX) {
+        me->src = arena_strdup(src);
+    } else {
+        return false;
+    }
+
+    me->is_file = (me->flags & MOUNT_FILE) || S_ISREG(stx.stx_mode);
+    return true;
+}
+
+/* Resolve the source of a mount entry, a single statx() call tells us both
+   whether it exists and whether it's a file or a directory. */
+static bool resolve_mount_entry(struct mount_entry *me)
+{
+    char src[PATH_MAX];
+    struct statx stx;
+
+    if ((me->flags & MOUNT_RESOLVE) && resolve_store_path(me))
+        return true;
+
+    if (me->flags & MOUNT_RESOLVE) {
+        if (realpath(me->path, src) == NULL)
+            // Skip missing mount source
+            return true;
+
+        me->src = arena_strdup(src);
+    } else {
+        me->src = me->path;
+    }
+
+    if (statx(AT_FDCWD, me->src, 0, STATX_TYPE, &stx) == -1) {
+        // Skip missing mount source
+        me->src = NULL;
+        return true;
+    }
+
+    me->is_file = (me->flags & MOUNT_FILE) || S_ISREG(stx.stx_mode);
+
+    if (me->flags & MOUNT_RESOLVE)
+        return collect_links(me);
+
+    return true;
+}
+
+/* Resolving the sources is nothing but lookups that are independent of each
+   other, so for large plans they're spread over a few threads to overlap
+   their latency. Only the mounts are done one after another afterwards. */
+#define RESOLVE_MAX_THREADS 8
+#define RESOLVE_THREAD_ENTRIES 64
+#define RESOLVE_BATCH 16
+
+struct resolver {
+    size_t next;
+    bool failed;
+};
+
+static void *resolve_worker(void *data)
+{
+    struct resolver *r = data;
+    size_t i, end;
+
+    while (!__atomic_load_n(&r->failed, __ATOMIC_RELAXED)) {
+        i = __atomic_fetch_add(&r->next, RESOLVE_BATCH, __ATOMIC_RELAXED);
+        if (i >= mount_plan->count)
+            break;
+
+        end = i + RESOLVE_BATCH;
+        if (end > mount_plan->count)
+            end = mount_plan->count;
+
+        for (; i < end; ++i) {
+            if (!resolve_mount_entry(&mount_plan->entries[i])) {
+                __atomic_store_n(&r->failed, true, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Resolve all entries of the mount plan starting at the given one. */
+static bool resolve_mount_plan(size_t first)
+{
+    pthread_t threads[RESOLVE_MAX_THREADS - 1];
+    struct resolver r = { first, false };
+    size_t nthreads, started, i;
+
+    // Before the threads are started, which only read it.
+    if (real_store_dir[0] == '\0' &&
+        realpath(NIX_STORE_DIR, real_store_dir) == NULL)
+        real_store_dir[0] = '\0';
+
+    nthreads = (mount_plan->count - first) / RESOLVE_THREAD_ENTRIES;
+    if (nthreads > RESOLVE_MAX_THREADS)
+        nthreads = RESOLVE_MAX_THREADS;
+
+    /* If a thread can't be created, the remaining ones and the current one
+       just have to do more of the work. */
+    for (started = 0; started + 1 < nthreads; ++started) {
+        if (pthread_create(&threads[started], NULL, resolve_worker, &r) != 0)
+            break;
+    }
+
+    resolve_worker(&r);
+
+    // All threads need to be gone before we can setns() or unshare() again.
+    for (i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    return !r.failed;
+}
+
+static bool execute_mount_entry(struct mount_entry *me)
+{
+    if (me->src == NULL)
+        return true;
+
+    if (!make_links(me))
+        return false;
+
+    if (me->skip) {
+        trace_count(TRACE_PLAN_SKIPPED, 1);
+        return true;
+    }
+
+#ifdef SANDBOX_STORE_VIEW
+    if (is_store_view_path(me->src))
+        return allow_store_path(store_view, me->src);
+#endif
+
+    if (me->is_file)
+        return mount_file(me->src);
+    else
+        return mount_dir(me->src, me->flags);
+}
+
+/* Resolve all of the collected mounts, get rid of the ones that are
+   redundant and mount the remaining ones in order. */
+static bool execute_mount_plan(void)
+{
+    size_t i;
+
+    trace_count(TRACE_PLAN_ENTRIES, mount_plan->count);
+    optimize_mount_plan(mount_plan);
+
+    for (i = 0; i < mount_plan->count; ++i) {
+        if (!execute_mount_entry(&mount_plan->entries[i]))
+            return false;
+    }
+
+    return true;
+}
+
+struct envar_offset {
+    int start;
+    int length;
+    int var_start;
+    int var_length;
+    struct envar_offset *next;
+};
+
+static struct envar_offset *push_offset(struct envar_offset *current,
+                                        struct envar_offset **base)
+{
+    struct envar_offset *new_offset = arena_alloc(sizeof(struct envar_offset));
+
+    new_offset->next = NULL;
+
+    if (current == NULL)
+        *base = new_offset;
+    else
+        current->next = new_offset;
+
+    return new_offset;
+}
+
+#define MK_XDG_EXPAND(varname, fallback) \
+    if (strcmp(xdg_var, varname) == 0) { \
+        result = arena_alloc(homelen + sizeof fallback); \
+        memcpy(result, home, homelen); \
+        memcpy(result + homelen, fallback, sizeof fallback); \
+        return result; \
+    }
+
+static char *expand_xdg_fallback(const char *xdg_var)
+{
+    static char *home = NULL;
+    static size_t homelen;
+    char *result;
+
+    if (home == NULL) {
+        if ((home = setup_getenv("HOME")) == NULL) {
+            fputs("Unable find $HOME.\n", stderr);
+            return NULL;
+        }
+        homelen = strlen(home);
+    }
+
+    MK_XDG_EXPAND("XDG_DATA_HOME", "/.local/share");
+    MK_XDG_EXPAND("XDG_CONFIG_HOME", "/.config");
+    MK_XDG_EXPAND("XDG_CACHE_HOME", "/.cache");
+
+    return NULL;
+}
+
+static char *get_offset_var(struct envar_offset *offset, const char *haystack)
+{
+    char *name, *result;
+
+    name = arena_strndup(haystack + offset->var_start, offset->var_length);
+
+    if ((result = setup_getenv(name)) == NULL &&
+        (result = expand_xdg_fallback(name)) == NULL) {
+        fprintf(stderr, "Unable find variable %s in %s\n", name, haystack);
+        return NULL;
+    }
+
+    return result;
+}
+
+static char *replace_env_offsets(const char *path, struct envar_offset *offset)
+{
+    size_t buflen, pathlen, varlen, tmplen;
+    int inpos = 0, outpos = 0;
+    char *buf, *curvar;
+
+    buflen = pathlen = strlen(path);
+    buf = arena_alloc(buflen + 1);
+
+    for (; offset != NULL; offset = offset->next) {
+        if ((curvar = get_offset_var(offset, path)) == NULL)
+            return NULL;
+
+        varlen = strlen(curvar);
+        tmplen = varlen + (buflen - offset->length);
+
+        if (tmplen > buflen) {
+            buf = arena_grow(buf, buflen + 1, tmplen + 1);
+            buflen = tmplen;
+        }
+
+        memcpy(buf + outpos, path + inpos, offset->start - inpos);
+        outpos += offset->start - inpos;
+        inpos = offset->start;
+
+        memcpy(buf + outpos, curvar, varlen);
+        outpos += varlen;
+        inpos += offset->length;
+    }
+
+    memcpy(buf + outpos, path + inpos, pathlen - inpos);
+    *(buf + outpos + (pathlen - inpos)) = '\0';
+
+    return buf;
+}
+
+static char *replace_env(const char *path)
+{
+    int i = 0, start = 0, var_start = 0;
+    size_t pathlen;
+    bool in_var = false, curly = false;
+    struct envar_offset *base = NULL, *offset = NULL;
+
+    pathlen = strlen(path);
+
+    while (i < pathlen) {
+        if (path[i] == '$' && !curly && !in_var) {
+            if (i + 1 >= pathlen)
+                break;
+
+            start = i;
+
+            if (path[i + 1] == '{') {
                 curly = true;
                 var_start = i + 2;
                 ++i;
@@ -497,10 +918,7 @@ static char *replace_env(const char *path)
             ) {
                 in_var = false;
 
-                if ((offset = push_offset(offset, &base)) == NULL) {
-                    free_offsets(base);
-                    return NULL;
-                }
+                offset = push_offset(offset, &base);
 
                 offset->start = start;
                 offset->length = i - start;
@@ -512,10 +930,7 @@ static char *replace_env(const char *path)
             if (path[i] == '}') {
                 curly = false;
 
-                if ((offset = push_offset(offset, &base)) == NULL) {
-                    free_offsets(base);
-                    return NULL;
-                }
+                offset = push_offset(offset, &base);
 
                 offset->start = start;
                 offset->length = (i + 1) - offset->start;
@@ -528,10 +943,7 @@ static char *replace_env(const char *path)
     }
 
     if (in_var) {
-        if ((offset = push_offset(offset, &base)) == NULL) {
-            free_offsets(base);
-            return NULL;
-        }
+        offset = push_offset(offset, &base);
 
         offset->start = start;
         offset->length = i - start;
@@ -539,7 +951,7 @@ static char *replace_env(const char *path)
         offset->var_length = i - var_start;
     }
 
-    return replace_env_offset_free(path, base);
+    return replace_env_offsets(path, base);
 }
 
 bool extra_mount(const char *path, bool is_required)
@@ -549,126 +961,105 @@ bool extra_mount(const char *path, bool is_required)
     if ((expanded = replace_env(path)) == NULL)
         return false;
 
-    if (is_required && !makedirs(expanded, false))
-        return false;
-
-    if (!bind_mount(expanded, false, true, true)) {
-        free(expanded);
+    if (is_required && !makedirs(AT_FDCWD, expanded, false))
         return false;
-    }
 
-    free(expanded);
-    return true;
+    return bind_mount(expanded, false, true, true);
 }
 
 static bool setup_xauthority(void)
 {
     char *xauth, *home;
-    bool result;
     size_t homelen;
 
-    if ((xauth = getenv("XAUTHORITY")) != NULL)
+    if ((xauth = setup_getenv("XAUTHORITY")) != NULL)
         return bind_file(xauth);
 
-    if ((home = getenv("HOME")) == NULL) {
+    if ((home = setup_getenv("HOME")) == NULL) {
         fputs("Unable find $HOME.\n", stderr);
         return false;
     }
 
     homelen = strlen(home);
 
-    if ((xauth = malloc(homelen + 13)) == NULL) {
-        perror("malloc xauth file path");
-        return false;
-    }
-
+    xauth = arena_alloc(homelen + 13);
     memcpy(xauth, home, homelen);
     memcpy(xauth + homelen, "/.Xauthority", 13);
 
-    result = bind_file(xauth);
-    free(xauth);
-    return result;
+    return bind_file(xauth);
 }
 
 #ifdef BINSH_EXECUTABLE
 static bool setup_binsh(const char *executable)
 {
-    if (!makedirs(FS_ROOT_DIR "/bin", false))
+    if (!makedirs(root_fd, "bin", true))
         return false;
 
-    if (symlink(executable, FS_ROOT_DIR "/bin/sh") == -1) {
+    if (symlinkat(executable, root_fd, "bin/sh") == -1) {
         fprintf(stderr, "creating symlink from %s to %s: %s\n",
                 executable, FS_ROOT_DIR "/bin/sh", strerror(errno));
         return false;
     }
+    trace_count(TRACE_SYMLINKS, 1);
     return true;
 }
 #endif
 
 #ifndef FULL_NIX_STORE
-static bool is_dir(const char *path)
-{
-    struct stat sb;
-    if (stat(path, &sb) == -1) {
-        fprintf(stderr, "stat %s: %s\n", path, strerror(errno));
-        // Default to directory for mounting
-        return true;
-    }
-    return S_ISDIR(sb.st_mode);
-}
+/* The runtime closure is queried on its own thread, while the main thread
+   collects and resolves the rest of the mount plan. The results are only
+   added to the mount plan after the thread has been joined. */
+static struct {
+    pthread_t thread;
+    bool started;
+    bool result;
+    const char **paths;
+    size_t count;
+    size_t alloc;
+} runtime_query;
 
-static bool mount_requisites(struct query_state *qs, const char *path)
+static void collect_query_results(struct query_state *qs)
 {
     const char *requisite;
-
-    if (!query_requisites(qs, path)) {
-        fprintf(stderr, "Unable to get requisites for %s.\n", path);
-        return false;
-    }
+    size_t newalloc;
 
     while ((requisite = next_query_result(qs)) != NULL) {
-        if (is_dir(requisite)) {
-            if (!bind_mount(requisite, true, true, false))
-                return false;
-        } else {
-            if (!bind_file(requisite))
-                return false;
+        if (runtime_query.count == runtime_query.alloc) {
+            newalloc = runtime_query.alloc == 0 ? 256 : runtime_query.alloc * 2;
+            runtime_query.paths = arena_grow(runtime_query.paths,
+                                             runtime_query.alloc * sizeof(char*),
+                                             newalloc * sizeof(char*));
+            runtime_query.alloc = newalloc;
         }
-    }
 
-    return true;
+        runtime_query.paths[runtime_query.count++] = requisite;
+    }
 }
 
-bool mount_from_path_var(struct query_state *qs, const char *name)
+bool add_path_var_roots(struct query_state *qs, const char *name)
 {
-    char *buf, *ptr, *value = getenv(name);
+    char *buf, *ptr, *value = setup_getenv(name);
 
     if (value == NULL)
         return true;
 
-    if ((buf = strdup(value)) == NULL) {
-        fprintf(stderr, "strdup %s: %s\n", value, strerror(errno));
-        return false;
-    }
-
+    buf = arena_strdup(value);
     ptr = strtok(buf, ":");
 
     while (ptr != NULL) {
-        if (!mount_requisites(qs, ptr)) {
-            free(buf);
+        if (!add_query_root(qs, ptr))
             return false;
-        }
         ptr = strtok(NULL, ":");
     }
 
-    free(buf);
     return true;
 }
 
+#ifndef SELECTIVE_ETC
 /* `/etc/static` is a special symlink on NixOS, pointing to a storepath
    of configs that have to be available at runtime for some programs
    to function. So we need to mount the closure of that storepath. */
-static bool setup_static_etc(struct query_state *qs)
+static bool add_static_etc_root(struct query_state *qs)
 {
     char dest[PATH_MAX];
     ssize_t destlen;
@@ -682,159 +1073,636 @@ static bool setup_static_etc(struct query_state *qs)
     }
 
     dest[destlen] = '\0';
-    return mount_requisites(qs, dest);
+    return add_query_root(qs, dest);
 }
+#endif
 
-/* Bind-mount all necessary nix store paths. */
-static bool setup_runtime_paths(void)
+static bool collect_requisites(struct query_state *qs)
 {
-    struct query_state *qs;
-
-    if ((qs = new_query()) == NULL) {
-        fputs("Unable to allocate Nix query state.\n", stderr);
+    if (!query_requisites(qs)) {
+        fputs("Unable to get runtime requisites.\n", stderr);
         return false;
     }
 
-    if (!setup_static_etc(qs)) {
-        free_query(qs);
-        return false;
+    collect_query_results(qs);
+    return true;
+}
+
+#ifdef SELECTIVE_ETC
+/* Add the store paths that the selected entries of /etc resolve to. Missing
+   entries and the ones outside of the store don't have a closure. */
+static bool add_etc_roots(struct query_state *qs)
+{
+    char path[PATH_MAX], resolved[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < etc_path_count; ++i) {
+        if (snprintf(path, PATH_MAX, "/etc/%s", etc_paths[i]) >= PATH_MAX) {
+            fprintf(stderr, "Path /etc/%s is larger than PATH_MAX.\n",
+                    etc_paths[i]);
+            return false;
+        }
+
+        if (realpath(path, resolved) == NULL ||
+            strncmp(resolved, NIX_STORE_DIR "/", sizeof NIX_STORE_DIR) != 0)
+            continue;
+
+        if (!add_query_root(qs, resolved))
+            return false;
     }
 
-    if (!mount_runtime_path_vars(qs)) {
-        free_query(qs);
+    return true;
+}
+
+/* The closures of the selected entries only change along with the system
+   generation, so they're snapshotted by the target of /etc/static, which
+   spares us resolving the entries as long as the generation is the same. */
+static bool collect_etc_requisites(struct query_state *qs)
+{
+    char generation[PATH_MAX];
+    ssize_t len;
+
+    // Not NixOS, so there is no generation to key the snapshot by.
+    if ((len = readlink("/etc/static", generation, PATH_MAX - 1)) == -1)
+        return add_etc_roots(qs) && collect_requisites(qs);
+
+    generation[len] = '\0';
+
+    if (!query_snapshot(qs, generation, add_etc_roots)) {
+        fputs("Unable to get requisites of /etc.\n", stderr);
         return false;
     }
 
-    free_query(qs);
+    collect_query_results(qs);
     return true;
 }
 #endif
 
-static bool setup_runtime_debug(void)
+/* Query all necessary nix store paths. The closures of all the runtime
+   roots are computed at once, so shared dependencies are only queried and
+   mounted once. Paths of the mount table are mounted anyway, so the query
+   doesn't need to descend into them. */
+static bool setup_runtime_paths(void)
 {
-    char *injected_files, *buf, *ptr, *equals, *target;
+    const char **mounted = arena_alloc(app_mount_count * sizeof(char*));
+    struct query_state *qs;
+    size_t i;
 
-    if ((injected_files = getenv("NIX_SANDBOX_DEBUG_INJECT_DIRS")) == NULL)
-        return true;
+    for (i = 0; i < app_mount_count; ++i)
+        mounted[i] = app_mounts[i].path;
 
-    if ((buf = strdup(injected_files)) == NULL) {
-        perror("strdup NIX_SANDBOX_DEBUG_INJECT_DIRS");
-        return false;
-    }
+    qs = new_query(mounted, app_mount_count);
 
-    ptr = strtok(buf, ":");
+    trace_begin(TRACE_ETC_STATIC);
 
-    while (ptr != NULL) {
-        if ((equals = strchr(ptr, '=')) != NULL) {
-            *equals = '\0';
+#ifdef SELECTIVE_ETC
+    if (!collect_etc_requisites(qs))
+        return false;
+#else
+    if (!add_static_etc_root(qs))
+        return false;
+#endif
 
-            if ((target = get_mount_target(equals + 1)) == NULL) {
-                free(buf);
-                return false;
-            }
+    trace_end(TRACE_ETC_STATIC);
 
-            if (!makedirs(target, true)) {
-                free(target);
-                free(buf);
-                return false;
-            }
+    if (!add_runtime_path_vars(qs))
+        return false;
 
-            if (mount(ptr, target, "", MS_BIND, NULL) == -1) {
-                fprintf(stderr, "mount injected directory %s to %s: %s\n",
-                        ptr, target, strerror(errno));
-                free(target);
-                free(buf);
-                return false;
-            }
+    return collect_requisites(qs);
+}
 
-            free(target);
-            fprintf(stderr, "Injected directory '%s' to '%s'.\n",
-                    ptr, equals + 1);
-        }
+static void *runtime_query_worker(void *data)
+{
+    trace_begin(TRACE_RUNTIME_PATHS);
+    runtime_query.result = setup_runtime_paths();
+    trace_end(TRACE_RUNTIME_PATHS);
+    return NULL;
+}
 
-        ptr = strtok(NULL, ":");
+static bool start_runtime_query(void)
+{
+    if (pthread_create(&runtime_query.thread, NULL, runtime_query_worker,
+                       NULL) != 0) {
+        // Not fatal, the query just doesn't overlap with anything then.
+        runtime_query_worker(NULL);
+        return runtime_query.result;
     }
 
-    free(buf);
+    runtime_query.started = true;
     return true;
 }
 
-static bool setup_chroot(void)
+static bool finish_runtime_query(void)
 {
-    int mflags;
+    if (!runtime_query.started)
+        return true;
 
-    mflags = MS_NOEXEC | MS_NOSUID | MS_NODEV | MS_NOATIME;
+    pthread_join(runtime_query.thread, NULL);
+    runtime_query.started = false;
+    return runtime_query.result;
+}
+#endif
 
-    if (mount("none", FS_ROOT_DIR, "tmpfs", mflags, NULL) == -1) {
-        perror("mount rootfs");
+#if !defined(FULL_NIX_STORE) && !defined(SANDBOX_STORE_VIEW)
+static bool is_store_entry(const struct mount_entry *me)
+{
+    return strncmp(me->path, NIX_STORE_DIR "/", sizeof NIX_STORE_DIR) == 0;
+}
+
+/* Every bind mount costs a few syscalls, so for very large closures a single
+   read-only mount of the whole store is a lot cheaper than mounting each of
+   the store paths, at the expense of exposing the rest of the store. If so,
+   the store paths are removed from the mount plan. */
+static bool choose_store_mounts(size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < mount_plan->count; ++i) {
+        if (is_store_entry(&mount_plan->entries[i]))
+            count++;
+    }
+
+    trace_count(TRACE_STORE_PATHS, count);
+
+    if (!EXCEEDS_STORE_THRESHOLD(count))
         return false;
+
+    remove_mount_entries(mount_plan, is_store_entry);
+    trace_count(TRACE_WHOLE_STORE, 1);
+    return true;
+}
+#endif
+
+#ifndef FULL_NIX_STORE
+/* Add the results of the runtime query to the mount plan, or the whole store
+   instead. Returns the first entry that has been added. */
+static size_t add_runtime_mounts(void)
+{
+    size_t first, i;
+
+#ifndef SANDBOX_STORE_VIEW
+    if (choose_store_mounts(runtime_query.count)) {
+        first = mount_plan->count;
+        add_mount_entry(mount_plan, NIX_STORE_DIR,
+                        APP_STORE_FLAGS | MOUNT_STATIC);
+        return first;
     }
+#endif
 
-    if (!bind_mount("/etc", true, true, false))
+    first = mount_plan->count;
+    reserve_mount_plan(mount_plan, first + runtime_query.count);
+
+    // The results are interned by the query, so they aren't copied again.
+    for (i = 0; i < runtime_query.count; ++i)
+        add_mount_entry(mount_plan, runtime_query.paths[i],
+                        MOUNT_RDONLY | MOUNT_RESTRICTED | MOUNT_STATIC);
+
+    return first;
+}
+#endif
+
+#ifdef SELECTIVE_ETC
+/* Only mount the entries of /etc that have been selected at build time
+   instead of all of it. Symlinks to /etc/static are recreated on the way. */
+static bool setup_etc(void)
+{
+    char path[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < etc_path_count; ++i) {
+        if (snprintf(path, PATH_MAX, "/etc/%s", etc_paths[i]) >= PATH_MAX) {
+            fprintf(stderr, "Path /etc/%s is larger than PATH_MAX.\n",
+                    etc_paths[i]);
+            return false;
+        }
+
+        if (!bind_mount(path, true, true, true))
+            return false;
+    }
+
+    return true;
+}
+#endif
+
+static bool setup_runtime_debug(void)
+{
+    char *injected_files, *buf, *ptr, *equals;
+    const char *target;
+
+    injected_files = setup_getenv("NIX_SANDBOX_DEBUG_INJECT_DIRS");
+    if (injected_files == NULL)
+        return true;
+
+    buf = arena_strdup(injected_files);
+    ptr = strtok(buf, ":");
+
+    while (ptr != NULL) {
+        if ((equals = strchr(ptr, '=')) != NULL) {
+            *equals = '\0';
+
+            target = to_relative(equals + 1);
+
+            if (!makedirs(root_fd, target, true))
+                return false;
+
+            if (!bind_path(ptr, target, 0, false))
+                return false;
+
+            fprintf(stderr, "Injected directory '%s' to '%s'.\n",
+                    ptr, equals + 1);
+        }
+
+        ptr = strtok(NULL, ":");
+    }
+
+    return true;
+}
+
+static bool mount_rootfs(void)
+{
+    int mflags;
+
+#ifdef HAVE_NEW_MOUNT_API
+    unsigned int attrs;
+    int fsfd, mntfd;
+
+    attrs = MOUNT_ATTR_NOEXEC | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV
+          | MOUNT_ATTR_NOATIME;
+
+    if ((fsfd = fsopen("tmpfs", FSOPEN_CLOEXEC)) != -1) {
+        if (fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == -1) {
+            perror("create rootfs");
+            close(fsfd);
+            return false;
+        }
+
+        mntfd = fsmount(fsfd, FSMOUNT_CLOEXEC, attrs);
+        close(fsfd);
+
+        if (mntfd == -1) {
+            perror("fsmount rootfs");
+            return false;
+        }
+
+        root_fd = mntfd;
+        trace_count(TRACE_MOUNTS, 1);
+        return true;
+    } else if (!is_unsupported(errno)) {
+        perror("fsopen rootfs");
         return false;
+    }
 
-    if (!bind_mount("/dev", false, false, false))
+    new_mount_api = false;
+#endif
+
+    mflags = MS_NOEXEC | MS_NOSUID | MS_NODEV | MS_NOATIME;
+
+    if (mount("none", FS_ROOT_DIR, "tmpfs", mflags, NULL) == -1) {
+        perror("mount rootfs");
+        return false;
+    }
+
+    root_attached = true;
+    trace_count(TRACE_MOUNTS, 1);
+
+    if ((root_fd = open(FS_ROOT_DIR, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        perror("open rootfs");
         return false;
+    }
+
+    return true;
+}
 
 #if (EXTRA_NS_FLAGS) & CLONE_NEWPID
-        if (!makedirs(FS_ROOT_DIR "/proc", false))
+static bool mount_proc(void)
+{
+    if (!makedirs(root_fd, "proc", true))
+        return false;
+
+#ifdef HAVE_NEW_MOUNT_API
+    if (new_mount_api) {
+        int fsfd, mntfd;
+
+        if ((fsfd = fsopen("proc", FSOPEN_CLOEXEC)) == -1) {
+            perror("fsopen /proc");
             return false;
+        }
 
-        if (mount("none", FS_ROOT_DIR "/proc", "proc", 0, NULL) == -1) {
-            perror("mount /proc");
+        if (fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == -1) {
+            perror("create /proc");
+            close(fsfd);
             return false;
         }
-#else
-        if (!bind_mount("/proc", false, false, false))
+
+        mntfd = fsmount(fsfd, FSMOUNT_CLOEXEC, 0);
+        close(fsfd);
+
+        if (mntfd == -1) {
+            perror("fsmount /proc");
             return false;
+        }
+
+        if (!attach_mount(mntfd, "proc")) {
+            perror("mount /proc");
+            close(mntfd);
+            return false;
+        }
+
+        close(mntfd);
+        trace_count(TRACE_MOUNTS, 1);
+        return true;
+    }
 #endif
 
-    if (!bind_mount("/sys", false, false, false))
+    if (!attach_rootfs())
         return false;
 
-    if (!bind_mount("/run", false, false, false))
+    if (mount("none", FS_ROOT_DIR "/proc", "proc", 0, NULL) == -1) {
+        perror("mount /proc");
         return false;
+    }
 
-    if (!bind_mount("/var/run", false, false, false))
+    trace_count(TRACE_MOUNTS, 1);
+    return true;
+}
+#endif
+
+#ifdef SANDBOX_STORE_VIEW
+/* Mount a FUSE file system on the store, which only exposes the allowed store
+   paths. This is a single mount regardless of the size of the closure. */
+static bool mount_store_view(void)
+{
+    const char *target = to_relative(NIX_STORE_DIR);
+    char fd_str[16], uid_str[16], gid_str[16], opts[128];
+    int fuse_fd;
+
+    if (!makedirs(root_fd, target, true))
         return false;
 
-    if (!bind_mount("/tmp", false, true, false))
+    if ((fuse_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC)) == -1) {
+        perror("open /dev/fuse");
+        return false;
+    }
+
+    snprintf(fd_str, sizeof fd_str, "%d", fuse_fd);
+    snprintf(uid_str, sizeof uid_str, "%u", geteuid());
+    snprintf(gid_str, sizeof gid_str, "%u", getegid());
+
+#ifdef HAVE_NEW_MOUNT_API
+    if (new_mount_api) {
+        const char *options[][2] = {
+            { "source", "store-view" },
+            { "fd", fd_str },
+            { "rootmode", "40000" },
+            { "user_id", uid_str },
+            { "group_id", gid_str },
+        };
+        unsigned int attrs;
+        int fsfd, mntfd;
+        size_t i;
+
+        if ((fsfd = fsopen("fuse", FSOPEN_CLOEXEC)) == -1) {
+            perror("fsopen store view");
+            close(fuse_fd);
+            return false;
+        }
+
+        for (i = 0; i < sizeof options / sizeof options[0]; ++i) {
+            if (fsconfig(fsfd, FSCONFIG_SET_STRING, options[i][0],
+                         options[i][1], 0) == -1) {
+                fprintf(stderr, "store view option %s: %s\n",
+                        options[i][0], strerror(errno));
+                close(fsfd);
+                close(fuse_fd);
+                return false;
+            }
+        }
+
+        if (fsconfig(fsfd, FSCONFIG_SET_FLAG, "default_permissions",
+                     NULL, 0) == -1 ||
+            fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == -1) {
+            perror("create store view");
+            close(fsfd);
+            close(fuse_fd);
+            return false;
+        }
+
+        attrs = MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV;
+        mntfd = fsmount(fsfd, FSMOUNT_CLOEXEC, attrs);
+        close(fsfd);
+
+        if (mntfd == -1 || !attach_mount(mntfd, target)) {
+            perror("mount store view");
+            if (mntfd != -1)
+                close(mntfd);
+            close(fuse_fd);
+            return false;
+        }
+
+        close(mntfd);
+    } else
+#endif
+    {
+        snprintf(opts, sizeof opts, "fd=%s,rootmode=40000,user_id=%s,"
+                 "group_id=%s,default_permissions", fd_str, uid_str, gid_str);
+
+        if (!attach_rootfs()) {
+            close(fuse_fd);
+            return false;
+        }
+
+        if (mount("store-view", FS_ROOT_DIR NIX_STORE_DIR, "fuse",
+                  MS_RDONLY | MS_NOSUID | MS_NODEV, opts) == -1) {
+            perror("mount store view");
+            close(fuse_fd);
+            return false;
+        }
+    }
+
+    trace_count(TRACE_MOUNTS, 1);
+
+    if (!start_store_view(store_view, store_view_fd, fuse_fd)) {
+        store_view_fd = -1;
+        close(fuse_fd);
         return false;
+    }
 
-    // We don’t need to query the nix store if we mount the full store
+    store_view_fd = -1;
+    close(fuse_fd);
+    return true;
+}
+#endif
+
+static bool setup_chroot(void)
+{
+    size_t first = 0;
+
+    /* We don’t need to query the nix store if we mount the full store, which
+       we do anyway if the static closure alone is above the threshold. */
 #ifndef FULL_NIX_STORE
-    if (!setup_runtime_paths())
+    if (!EXCEEDS_STORE_THRESHOLD(app_mount_count) && !start_runtime_query())
         return false;
 #endif
 
+#ifdef SANDBOX_STORE_VIEW
+    if ((store_view = new_store_view()) == NULL)
+        goto fail;
+#endif
+
+#ifdef SELECTIVE_ETC
+    if (!setup_etc())
+        goto fail;
+#else
+    if (!bind_mount("/etc", true, true, false))
+        goto fail;
+#endif
+
+    if (!bind_mount("/dev", false, false, false))
+        goto fail;
+
+#if !((EXTRA_NS_FLAGS) & CLONE_NEWPID)
+    if (!bind_mount("/proc", false, false, false))
+        goto fail;
+#endif
+
+    if (!bind_mount("/sys", false, false, false))
+        goto fail;
+
+    if (!bind_mount("/run", false, false, false))
+        goto fail;
+
+    if (!bind_mount("/var/run", false, false, false))
+        goto fail;
+
+    if (!bind_mount("/tmp", false, true, false))
+        goto fail;
+
+    trace_begin(TRACE_APP_PATHS);
+
     if (!setup_app_paths())
-        return false;
+        goto fail;
 
     if (!setup_xauthority())
-        return false;
+        goto fail;
+
+    trace_end(TRACE_APP_PATHS);
+    trace_begin(TRACE_RESOLVE);
+
+    /* The rest of the plan is resolved while the runtime query is still
+       running, so afterwards only its results are left to resolve. */
+#ifndef FULL_NIX_STORE
+    if (runtime_query.started) {
+        if (!resolve_mount_plan(0))
+            goto fail;
+
+        if (!finish_runtime_query())
+            goto fail;
+
+        first = add_runtime_mounts();
+    } else {
+        add_runtime_mounts();
+    }
+#endif
+
+    if (!resolve_mount_plan(first))
+        goto fail;
+
+    trace_end(TRACE_RESOLVE);
+
+    /* Everything up to here only collects the mount plan, so the root is
+       mounted as late as possible. Without the new mount API, it's mounted
+       on top of FS_ROOT_DIR, which would hide the query backend. */
+    trace_begin(TRACE_ROOTFS);
+
+    if (!mount_rootfs())
+        goto fail;
+
+    trace_end(TRACE_ROOTFS);
+    trace_begin(TRACE_MOUNT_PLAN);
+
+    if (!execute_mount_plan())
+        goto fail;
+
+    trace_end(TRACE_MOUNT_PLAN);
+
+#ifdef SANDBOX_STORE_VIEW
+    trace_begin(TRACE_STORE_VIEW);
+
+    if (!mount_store_view())
+        goto fail;
+
+    free_store_view(store_view);
+    store_view = NULL;
+    trace_end(TRACE_STORE_VIEW);
+#endif
+
+#if (EXTRA_NS_FLAGS) & CLONE_NEWPID
+    trace_begin(TRACE_PROC);
+
+    if (!mount_proc())
+        goto fail;
+
+    trace_end(TRACE_PROC);
+#endif
 
     if (!setup_runtime_debug())
-        return false;
+        goto fail;
 
 #ifdef BINSH_EXECUTABLE
     if (!setup_binsh(BINSH_EXECUTABLE))
-        return false;
+        goto fail;
 #endif
 
+    trace_begin(TRACE_CHROOT);
+
+    if (!attach_rootfs())
+        goto fail;
+
+    close(root_fd);
+
     if (chroot(FS_ROOT_DIR) == -1) {
         perror("chroot");
-        return false;
+        goto fail;
     }
 
     if (chdir("/") == -1) {
         perror("chdir rootfs");
-        return false;
+        goto fail;
     }
 
+    trace_end(TRACE_CHROOT);
     return true;
+
+fail:
+    // The query thread must not outlive a failed setup.
+#ifndef FULL_NIX_STORE
+    finish_runtime_query();
+#endif
+    return false;
 }
 
-bool setup_sandbox(void)
+static void wait_and_exit(pid_t pid)
+{
+    int wstatus;
+
+    if (waitpid(pid, &wstatus, 0) == -1) {
+        fputs("sandbox: waitpid failure", stderr);
+        _exit(EXIT_FAILURE);
+    } else if (WIFEXITED(wstatus)) {
+        _exit(WEXITSTATUS(wstatus));
+    } else if (WIFSIGNALED(wstatus)) {
+        fprintf(stderr, "sandbox: killed by signal %d\n", WTERMSIG(wstatus));
+        _exit(EXIT_FAILURE);
+    } else {
+        // WIFSTOPPED, WIFCONTINUED?
+        fputs("sandbox: wait failed", stderr);
+        _exit(EXIT_FAILURE);
+    }
+}
+
+/* Unshare the namespaces in the current process, with a helper process that
+   writes our id maps. */
+static bool unshare_namespaces(void)
 {
     int sync_pipe[2];
     char sync_status = '.';
@@ -862,6 +1730,7 @@ bool setup_sandbox(void)
             close(sync_pipe[0]);
             _exit(write_maps(parent_pid) ? 0 : 1);
         default:
+            trace_begin(TRACE_UNSHARE);
             if (unshare(CLONE_NEWNS | CLONE_NEWUSER | EXTRA_NS_FLAGS) == -1) {
                 perror("unshare");
                 if (write(sync_pipe[1], "X", 1) == -1)
@@ -870,8 +1739,11 @@ bool setup_sandbox(void)
                 return false;
             }
 
+            trace_end(TRACE_UNSHARE);
+            trace_begin(TRACE_WRITE_MAPS);
             close(sync_pipe[1]);
             waitpid(pid, &child_status, 0);
+            trace_end(TRACE_WRITE_MAPS);
             if (WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0)
                 break;
             return false;
@@ -885,34 +1757,665 @@ bool setup_sandbox(void)
     /* Just wait in the parent until the child exits. We need to fork because
      * otherwise we can't mount /proc in the right PID namespace.
      */
-    int wstatus;
+    if (pid > 0)
+        wait_and_exit(pid);
+
+    return true;
+}
+
+#ifdef HAVE_CLONE3
+static void exit_with_child(int pidfd, pid_t pid)
+{
+    siginfo_t info;
+
+    // Waiting on a pidfd is only supported since Linux 5.4.
+    if (waitid(IDTYPE_PIDFD, pidfd, &info, WEXITED) == -1 &&
+        (errno != EINVAL || waitid(P_PID, pid, &info, WEXITED) == -1)) {
+        fputs("sandbox: waitid failure\n", stderr);
+        _exit(EXIT_FAILURE);
+    }
+
+    if (info.si_code == CLD_EXITED)
+        _exit(info.si_status);
+
+    fprintf(stderr, "sandbox: killed by signal %d\n", info.si_status);
+    _exit(EXIT_FAILURE);
+}
+
+/* Create all the namespaces at once with clone3(), the child is already in
+   the new PID namespace and writes its own id maps, so neither a helper
+   process nor a second fork is needed.
+
+   Returns the pid of the child in the parent and 0 in the child. If clone3()
+   isn't supported by the kernel, -1 is returned and unsupported is set to
+   true. */
+static pid_t clone_sandbox(int *pidfd, bool *unsupported)
+{
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+    int proc_pid_fd;
+    struct clone_args args = {
+        .flags = CLONE_NEWNS | CLONE_NEWUSER | CLONE_PIDFD | EXTRA_NS_FLAGS,
+        .pidfd = (uintptr_t)pidfd,
+        .exit_signal = SIGCHLD,
+    };
+    pid_t pid;
+
+    trace_begin(TRACE_UNSHARE);
+
+    if ((pid = syscall(SYS_clone3, &args, sizeof args)) == -1) {
+        if (errno == ENOSYS || errno == EINVAL || errno == E2BIG)
+            *unsupported = true;
+        else
+            perror("clone3");
+        return -1;
+    } else if (pid > 0) {
+        return pid;
+    }
+
+    trace_end(TRACE_UNSHARE);
+    trace_begin(TRACE_WRITE_MAPS);
+
+    if ((proc_pid_fd = open("/proc/self", O_RDONLY | O_DIRECTORY)) == -1) {
+        perror("open /proc/self");
+        return -1;
+    }
+
+    if (!write_idmaps(proc_pid_fd, uid, gid))
+        return -1;
+
+    trace_end(TRACE_WRITE_MAPS);
+    return 0;
+}
+
+/* Set up the sandbox in a child created by clone_sandbox(), the parent only
+   waits for the child and exits with its exit status. */
+static bool clone_namespaces(bool *unsupported)
+{
+    int pidfd = -1;
+    pid_t pid;
+
+    switch (pid = clone_sandbox(&pidfd, unsupported)) {
+        case -1:
+            return false;
+        case 0:
+            return true;
+        default:
+#ifdef SANDBOX_STORE_VIEW
+            // Only the sandbox hands the store view to the server.
+            close(store_view_fd);
+#endif
+            exit_with_child(pidfd, pid);
+            return false;
+    }
+}
+#endif
+
+#if defined(SANDBOX_SESSIONS) || defined(SANDBOX_TEMPLATE)
+/* Don't keep the terminal or pipes of the launch that created a session or
+   template open, otherwise eg. a command substitution would never finish. */
+static void detach_stdio(void)
+{
+    int fd;
+
+    if ((fd = open("/dev/null", O_RDWR)) == -1)
+        return;
+
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+
+    if (fd > STDERR_FILENO)
+        close(fd);
+}
+#endif
+
+#ifdef SANDBOX_SESSIONS
+/* Exit status of the process creating a session if clone3() isn't
+   supported, see spawn_session(). */
+#define SESSION_UNSUPPORTED 2
+
+/* Join the namespaces of a running session of this wrapper. If there is
+   none or it was set up for other values of the environment, joined is left
+   alone and we set up a new sandbox instead.
+
+   The session lock is held by every member of the session, so that the
+   holder only exits once all of them are gone. It's inherited across exec
+   and released once every process of the launch holding it has exited,
+   including ones that outlive it. */
+static bool join_session(bool *joined, bool *env_differs)
+{
+    int pidfd, lock_fd;
+    pid_t pid;
+
+    if ((pidfd = open_session(&lock_fd, env_differs)) == -1)
+        return true;
+
+    // Joining all namespaces via pidfd is supported since Linux 5.8.
+    if (setns(pidfd, CLONE_NEWNS | CLONE_NEWUSER | EXTRA_NS_FLAGS) == -1) {
+        close(lock_fd);
+        close(pidfd);
+        return true;
+    }
+
+    close(pidfd);
+
+    // The PID namespace only applies to our children.
+    if ((pid = fork()) == -1) {
+        perror("fork session member");
+        return false;
+    }
+
     if (pid > 0) {
+        close(lock_fd);
+        wait_and_exit(pid);
+    }
 
-        if (waitpid(pid, &wstatus, 0) == -1) {
-          fputs("sandbox: waitpid failure", stderr);
-          _exit(EXIT_FAILURE);
-        }
-        else if (WIFEXITED(wstatus)) {
-          _exit(WEXITSTATUS(wstatus));
-        }
-        else if (WIFSIGNALED(wstatus)) {
-          fprintf(stderr, "sandbox: killed by signal %d\n", WTERMSIG(wstatus));
-          _exit(EXIT_FAILURE);
+    if (fcntl(lock_fd, F_SETFD, 0) == -1) {
+        perror("fcntl session lock");
+        return false;
+    }
+
+    if (chroot(FS_ROOT_DIR) == -1) {
+        perror("chroot session");
+        return false;
+    }
+
+    if (chdir("/") == -1) {
+        perror("chdir session rootfs");
+        return false;
+    }
+
+    *joined = true;
+    return true;
+}
+
+static void wake_session(int sig)
+{
+    (void)sig;
+}
+
+/* Keep the namespaces of the session alive as its PID 1, until all of its
+   members have exited. They hold the session lock, so we just wait until we
+   can lock it exclusively and reap the members that got orphaned in the
+   meantime. Members might close the lock though, eg. when they start a
+   daemon, so /proc is checked as well and polled for those. */
+static void run_session(void)
+{
+    struct sigaction sa = { .sa_handler = wake_session };
+
+    // Interrupt flock() whenever an orphaned member exits.
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (;;) {
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+
+        if (flock(session_lock_fd, LOCK_EX) == -1) {
+            if (errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
         }
-        else {
-          // WIFSTOPPED, WIFCONTINUED?
-          fputs("sandbox: wait failed", stderr);
-          _exit(EXIT_FAILURE);
+
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+
+        /* The lock stays locked until we exit, so that launches waiting for
+           it don't join a session that is about to go away. */
+        if (!has_session_members())
+            _exit(EXIT_SUCCESS);
+
+        flock(session_lock_fd, LOCK_UN);
+        sleep(1);
+    }
+}
+
+/* Set up the sandbox of a new session in a child, which stays around as
+   the holder of the session. It's only published once it's ready, so a
+   failed sandbox is never published. Like templates, the session is
+   published along with the environment variables the child has read. */
+static void create_session(void)
+{
+    bool unsupported = false;
+    int pidfd = -1, ready_pipe[2];
+    char env_names[PIPE_BUF];
+    ssize_t len;
+    pid_t pid;
+
+    if (pipe2(ready_pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        _exit(EXIT_FAILURE);
+    }
+
+    // Opened before the chroot, the holder can't get to it afterwards.
+    if ((session_lock_fd = open_session_lock()) == -1)
+        _exit(EXIT_FAILURE);
+
+    if ((pid = clone_sandbox(&pidfd, &unsupported)) == -1)
+        _exit(unsupported ? SESSION_UNSUPPORTED : EXIT_FAILURE);
+
+    if (pid == 0) {
+        close(ready_pipe[0]);
+
+        cached_paths = new_path_cache();
+        mount_plan = new_mount_plan();
+
+        if (!setup_chroot())
+            _exit(EXIT_FAILURE);
+
+        arena_release();
+        detach_stdio();
+
+        if (setup_env_overflow)
+            _exit(EXIT_FAILURE);
+
+        setup_env[setup_env_len++] = '\n';
+        if (write(ready_pipe[1], setup_env, setup_env_len) == -1)
+            _exit(EXIT_FAILURE);
+
+        close(ready_pipe[1]);
+        run_session();
+    }
+
+    close(ready_pipe[1]);
+
+    len = read(ready_pipe[0], env_names, sizeof env_names - 1);
+
+    if (len <= 0 || env_names[len - 1] != '\n') {
+        kill(pid, SIGKILL);
+        _exit(EXIT_FAILURE);
+    }
+
+    env_names[len - 1] = '\0';
+
+    if (!publish_session(pid, env_names)) {
+        kill(pid, SIGKILL);
+        _exit(EXIT_FAILURE);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+/* Create a new session and wait until it's published. The holder is
+   detached from the launch, because it outlives it, and the launch joins
+   the session like any other one. */
+static bool spawn_session(int lock_fd, bool *unsupported)
+{
+    int status;
+    pid_t pid;
+
+    if ((pid = fork()) == -1) {
+        perror("fork session");
+        return false;
+    } else if (pid == 0) {
+        close(lock_fd);
+        if (setsid() == -1)
+            _exit(EXIT_FAILURE);
+        create_session();
+    }
+
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status))
+        return false;
+
+    *unsupported = WEXITSTATUS(status) == SESSION_UNSUPPORTED;
+    return WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/* Join the running session of this wrapper and create it first if there is
+   none yet. If we can't use a session, eg. because the running one was
+   created with a different environment or clone3() isn't supported, joined
+   is left alone and we set up a sandbox of our own. */
+static bool setup_session(const char *program, bool *joined)
+{
+    bool unsupported = false, env_differs = false, result;
+    int lock_fd;
+
+    if (!join_session(joined, &env_differs))
+        return false;
+
+    if (*joined || env_differs)
+        return true;
+
+    // Keep the new session from ending before we could join it.
+    if ((lock_fd = open_session_lock()) == -1)
+        return true;
+
+    if (flock(lock_fd, LOCK_SH) == -1) {
+        close(lock_fd);
+        return true;
+    }
+
+    // The new session is set up from scratch, so prefetch for it.
+#ifdef SANDBOX_READAHEAD
+    start_readahead(program);
+#endif
+
+    if (!spawn_session(lock_fd, &unsupported)) {
+        close(lock_fd);
+        return unsupported;
+    }
+
+    // Only the member returns, the launch waits for it.
+    result = join_session(joined, &env_differs);
+    close(lock_fd);
+    return result;
+}
+#endif
+
+#ifdef SANDBOX_TEMPLATE
+/* Run the template daemon, which sets up the sandbox in a child that stays
+   around with the finished mount tree. The daemon publishes the template
+   and removes it again after TEMPLATE_IDLE_SECONDS without any launches.
+
+   The mount tree depends on the environment variables of the launch that
+   created the template, so the child reports the ones it has read and the
+   template is published along with them. */
+static void run_template(int ready_fd)
+{
+    bool unsupported = false;
+    int pidfd = -1, template_pipe[2], file_fd;
+    char env_names[PIPE_BUF];
+    siginfo_t info;
+    ssize_t len;
+    pid_t pid;
+
+    if (pipe2(template_pipe, O_CLOEXEC) == -1) {
+        perror("pipe template");
+        _exit(EXIT_FAILURE);
+    }
+
+#ifdef SANDBOX_STORE_VIEW
+    if ((store_view_fd = fork_store_view()) == -1)
+        _exit(EXIT_FAILURE);
+#endif
+
+    if ((pid = clone_sandbox(&pidfd, &unsupported)) == -1)
+        _exit(EXIT_FAILURE);
+
+    if (pid == 0) {
+        close(ready_fd);
+        close(template_pipe[0]);
+
+        cached_paths = new_path_cache();
+        mount_plan = new_mount_plan();
+
+        if (!setup_chroot())
+            _exit(EXIT_FAILURE);
+
+        arena_release();
+
+        detach_stdio();
+
+        if (setup_env_overflow)
+            _exit(EXIT_FAILURE);
+
+        setup_env[setup_env_len++] = '\n';
+        if (write(template_pipe[1], setup_env, setup_env_len) == -1)
+            _exit(EXIT_FAILURE);
+
+        close(template_pipe[1]);
+
+        for (;;)
+            pause();
+    }
+
+    close(template_pipe[1]);
+#ifdef SANDBOX_STORE_VIEW
+    close(store_view_fd);
+#endif
+
+    len = read(template_pipe[0], env_names, sizeof env_names - 1);
+
+    if (len <= 0 || env_names[len - 1] != '\n') {
+        kill(pid, SIGKILL);
+        _exit(EXIT_FAILURE);
+    }
+
+    env_names[len - 1] = '\0';
+
+    if ((file_fd = publish_template(pid, env_names)) == -1) {
+        kill(pid, SIGKILL);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(template_pipe[0]);
+    detach_stdio();
+
+    if (write(ready_fd, "R", 1) == -1) {
+        kill(pid, SIGKILL);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(ready_fd);
+
+    do {
+        sleep(TEMPLATE_IDLE_SECONDS);
+
+        info.si_pid = 0;
+        if (waitid(P_PID, pid, &info, WEXITED | WNOHANG) == 0 &&
+            info.si_pid == pid)
+            _exit(EXIT_FAILURE);
+    } while (!is_template_idle(file_fd));
+
+    kill(pid, SIGKILL);
+    _exit(EXIT_SUCCESS);
+}
+
+/* Start the template daemon and wait until the template is ready. The
+   daemon is detached from the launch, because it outlives it. */
+static bool spawn_template(int creation_fd)
+{
+    int ready_pipe[2], status;
+    bool result;
+    char ready;
+    pid_t pid;
+
+    if (pipe2(ready_pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return false;
+    }
+
+    if ((pid = fork()) == -1) {
+        perror("fork template");
+        close(ready_pipe[0]);
+        close(ready_pipe[1]);
+        return false;
+    } else if (pid == 0) {
+        close(ready_pipe[0]);
+        close(creation_fd);
+
+        if (setsid() == -1 || (pid = fork()) == -1)
+            _exit(EXIT_FAILURE);
+
+        if (pid == 0)
+            run_template(ready_pipe[1]);
+
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(ready_pipe[1]);
+    waitpid(pid, &status, 0);
+    result = read(ready_pipe[0], &ready, 1) == 1;
+    close(ready_pipe[0]);
+    return result;
+}
+
+/* Copy the mount tree of the template into a new mount namespace, which the
+   kernel does in one go instead of us doing all the mounts again. All the
+   other namespaces are our own, so instances of the same wrapper are still
+   isolated from each other. */
+static bool join_template(int pidfd, int lock_fd, bool *joined)
+{
+    pid_t pid;
+
+    if (setns(pidfd, CLONE_NEWNS | CLONE_NEWUSER) == -1) {
+        close(pidfd);
+        close(lock_fd);
+        return true;
+    }
+
+    close(pidfd);
+    trace_begin(TRACE_UNSHARE);
+
+    if (unshare(CLONE_NEWNS | EXTRA_NS_FLAGS) == -1) {
+        perror("unshare template instance");
+        return false;
+    }
+
+    trace_end(TRACE_UNSHARE);
+
+    if ((pid = fork()) == -1) {
+        perror("fork template instance");
+        return false;
+    }
+
+    /* The instance keeps the template locked while it's in use. The lock is
+       inherited across exec and only released once every process of the
+       instance holding it has exited, including ones that outlive the
+       launch. */
+    if (pid > 0) {
+        close(lock_fd);
+        wait_and_exit(pid);
+    }
+
+    if (fcntl(lock_fd, F_SETFD, 0) == -1) {
+        perror("fcntl template lock");
+        return false;
+    }
+
+#if (EXTRA_NS_FLAGS) & CLONE_NEWPID
+    trace_begin(TRACE_PROC);
+
+    // The copied /proc belongs to the PID namespace of the template.
+    if (umount2(FS_ROOT_DIR "/proc", MNT_DETACH) == -1) {
+        perror("umount template /proc");
+        return false;
+    }
+
+    if (mount("none", FS_ROOT_DIR "/proc", "proc", 0, NULL) == -1) {
+        perror("mount /proc");
+        return false;
+    }
+
+    trace_count(TRACE_MOUNTS, 1);
+    trace_end(TRACE_PROC);
+#endif
+
+    trace_begin(TRACE_CHROOT);
+
+    if (chroot(FS_ROOT_DIR) == -1) {
+        perror("chroot template");
+        return false;
+    }
+
+    if (chdir("/") == -1) {
+        perror("chdir template rootfs");
+        return false;
+    }
+
+    trace_end(TRACE_CHROOT);
+    *joined = true;
+    return true;
+}
+
+/* Launch a new instance from the template of this wrapper and create the
+   template first if there is none yet. If we can't use a template, eg.
+   because the running one was created with a different environment, joined
+   is left alone and we set up a sandbox of our own. */
+static bool setup_from_template(const char *program, bool *joined)
+{
+    int pidfd, lock_fd, creation_fd;
+    bool env_differs = false;
+
+    if ((pidfd = open_template(&lock_fd, &env_differs)) == -1) {
+        // The template was set up for other environment variables.
+        if (env_differs)
+            return true;
+
+        if ((creation_fd = lock_template_creation()) == -1)
+            return true;
+
+        // Another launch might have created it while we waited for the lock.
+        if ((pidfd = open_template(&lock_fd, &env_differs)) == -1 &&
+            !env_differs) {
+            // The new template is set up from scratch, so prefetch for it.
+#ifdef SANDBOX_READAHEAD
+            start_readahead(program);
+#endif
+            if (spawn_template(creation_fd))
+                pidfd = open_template(&lock_fd, &env_differs);
         }
+
+        close(creation_fd);
+
+        if (pidfd == -1)
+            return true;
     }
 
-    cached_paths = new_path_cache();
+    return join_template(pidfd, lock_fd, joined);
+}
+#endif
 
-    if (!setup_chroot()) {
-        free_path_cache(cached_paths);
+/* Set up a new sandbox for the given program or join an existing one. */
+bool setup_sandbox(const char *program)
+{
+#ifdef HAVE_CLONE3
+    bool unsupported = false;
+#endif
+#if defined(SANDBOX_SESSIONS) || defined(SANDBOX_TEMPLATE)
+    bool joined = false;
+#endif
+
+    if (!init_trace())
+        return false;
+
+#ifdef SANDBOX_TEMPLATE
+    if (!setup_from_template(program, &joined))
+        return false;
+
+    if (joined) {
+        write_trace();
+        return true;
+    }
+#endif
+
+#ifdef SANDBOX_SESSIONS
+    if (!setup_session(program, &joined))
+        return false;
+
+    if (joined) {
+        write_trace();
+        return true;
+    }
+#endif
+
+    /* Only a new sandbox is worth prefetching for, the files of a running
+       one are in the page cache already. */
+#ifdef SANDBOX_READAHEAD
+    start_readahead(program);
+#endif
+
+#ifdef SANDBOX_STORE_VIEW
+    if ((store_view_fd = fork_store_view()) == -1)
         return false;
+#endif
+
+#ifdef HAVE_CLONE3
+    if (!clone_namespaces(&unsupported)) {
+        if (!unsupported || !unshare_namespaces())
+            return false;
     }
+#else
+    if (!unshare_namespaces())
+        return false;
+#endif
+
+    cached_paths = new_path_cache();
+    mount_plan = new_mount_plan();
+
+    if (!setup_chroot())
+        return false;
 
-    free_path_cache(cached_paths);
+    // Everything allocated during the setup is dropped at once.
+    arena_release();
+    write_trace();
     return true;
 }
@@ -3,13 +3,22 @@
 
 #include <stdbool.h>
 #include <sys/types.h>
-#include "nix-query.h"
+#include "mount-plan.h"
+#include "query.h"
+
+/* An entry of the mount table that is generated at build time. */
+struct app_mount {
+    const char *path;
+    int flags;
+};
+
+#define APP_STORE_FLAGS (MOUNT_RDONLY | MOUNT_RESTRICTED | MOUNT_RESOLVE)
 
-char *get_mount_target(const char *path);
 bool write_maps(pid_t parent_pid);
 bool bind_mount(const char *path, bool rdonly, bool restricted, bool resolve);
+bool add_app_mounts(const struct app_mount *mounts, size_t count);
 bool extra_mount(const char *path, bool is_required);
-bool mount_from_path_var(struct query_state *qs, const char *name);
-bool setup_sandbox(void);
+bool add_path_var_roots(struct query_state *qs, const char *name);
+bool setup_sandbox(const char *program);
 
 #endif
@@ -0,0 +1,223 @@
+/* Query backend with read-only access to the SQLite database of Nix, which
+   is an alternative to nix-query.cc without depending on libnix. */
+#include <sqlite3.h>
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "path-cache.h"
+#include "query-backend.h"
+
+#ifndef NIX_STATE_DIR
+#define NIX_STATE_DIR "/nix/var/nix"
+#endif
+
+static sqlite3 *db = NULL;
+static sqlite3_stmt *id_stmt = NULL;
+static sqlite3_stmt *refs_stmt = NULL;
+
+struct traversal {
+    closure_callback add;
+    void *data;
+
+    const char *const *mounted;
+    size_t nmounted;
+
+    path_cache visited;
+
+    // Database IDs of the paths that still need to be traversed.
+    sqlite3_int64 *queue;
+    size_t queue_count;
+    size_t queue_alloc;
+};
+
+static void close_db(void)
+{
+    sqlite3_finalize(id_stmt);
+    sqlite3_finalize(refs_stmt);
+    sqlite3_close(db);
+    id_stmt = refs_stmt = NULL;
+    db = NULL;
+}
+
+/* Build a read-only URI for the database file, escaping the characters that
+   have a meaning in URIs. */
+static bool get_db_uri(char *uri, const char *state_dir)
+{
+    char file[PATH_MAX];
+    size_t pos = 0;
+    const char *ptr;
+
+    if (snprintf(file, PATH_MAX, "%s/db/db.sqlite", state_dir) >= PATH_MAX)
+        return false;
+
+    for (ptr = "file:"; *ptr != '\0'; ++ptr)
+        uri[pos++] = *ptr;
+
+    for (ptr = file; *ptr != '\0' && pos + 3 < PATH_MAX; ++ptr) {
+        if (*ptr == '%' || *ptr == '?' || *ptr == '#')
+            pos += snprintf(uri + pos, 4, "%%%02x", (unsigned char)*ptr);
+        else
+            uri[pos++] = *ptr;
+    }
+
+    return *ptr == '\0' &&
+           snprintf(uri + pos, PATH_MAX - pos, "?mode=ro") < PATH_MAX - pos;
+}
+
+/* Open the database read-only. The database is in WAL mode, so SQLite still
+   needs the -shm file next to it, which users other than root usually can't
+   write to. Opening it as immutable instead would skip everything that
+   hasn't been checkpointed yet, so in that case we fail and the caller
+   falls back to libnix. */
+static bool open_db(void)
+{
+    const char *state_dir = getenv("NIX_STATE_DIR");
+    char uri[PATH_MAX];
+
+    if (db != NULL)
+        return true;
+
+    if (state_dir == NULL)
+        state_dir = NIX_STATE_DIR;
+
+    if (!get_db_uri(uri, state_dir)) {
+        fputs("Path of the Nix database is larger than PATH_MAX.\n", stderr);
+        return false;
+    }
+
+    if (sqlite3_open_v2(uri, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI,
+                        NULL) != SQLITE_OK) {
+        fprintf(stderr, "Unable to open Nix database %s: %s\n", uri,
+                sqlite3_errmsg(db));
+        close_db();
+        return false;
+    }
+
+    // Nix might be writing to the database at the same time.
+    sqlite3_busy_timeout(db, 60000);
+
+    // Preparing reads the schema, so this fails if the WAL can't be read.
+    if (sqlite3_prepare_v2(db, "SELECT id FROM ValidPaths WHERE path = ?",
+                           -1, &id_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT v.id, v.path FROM Refs r "
+                           "JOIN ValidPaths v ON v.id = r.reference "
+                           "WHERE r.referrer = ?",
+                           -1, &refs_stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Unable to query Nix database %s: %s\n", uri,
+                sqlite3_errmsg(db));
+        close_db();
+        return false;
+    }
+
+    return true;
+}
+
+bool open_backend(void)
+{
+    return open_db();
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool enqueue(struct traversal *t, sqlite3_int64 id, const char *path)
+{
+    sqlite3_int64 *newqueue;
+    size_t newalloc;
+
+    if (bsearch(&path, t->mounted, t->nmounted, sizeof(char*), path_cmp))
+        return true;
+
+    if (!cache_path(t->visited, path))
+        return true;
+
+    if (t->queue_count == t->queue_alloc) {
+        newalloc = t->queue_alloc == 0 ? 256 : t->queue_alloc * 2;
+        newqueue = realloc(t->queue, newalloc * sizeof(sqlite3_int64));
+        if (newqueue == NULL) {
+            perror("realloc query queue");
+            return false;
+        }
+        t->queue = newqueue;
+        t->queue_alloc = newalloc;
+    }
+
+    t->queue[t->queue_count++] = id;
+    return t->add(t->data, path);
+}
+
+static bool enqueue_root(struct traversal *t, const char *root)
+{
+    sqlite3_int64 id;
+    int ret;
+
+    sqlite3_bind_text(id_stmt, 1, root, -1, SQLITE_STATIC);
+    ret = sqlite3_step(id_stmt);
+    id = sqlite3_column_int64(id_stmt, 0);
+    sqlite3_reset(id_stmt);
+
+    if (ret == SQLITE_DONE) {
+        fprintf(stderr, "Path %s is not valid.\n", root);
+        return false;
+    } else if (ret != SQLITE_ROW) {
+        fprintf(stderr, "Unable to query %s: %s\n", root, sqlite3_errmsg(db));
+        return false;
+    }
+
+    return enqueue(t, id, root);
+}
+
+/* Walk the references of all roots at once, so every path is visited only
+   once, even if it's shared between several roots. */
+bool query_closure(const char *const *roots, size_t nroots,
+                   const char *const *mounted, size_t nmounted,
+                   closure_callback add, void *data)
+{
+    struct traversal t = {
+        .add = add, .data = data, .mounted = mounted, .nmounted = nmounted
+    };
+    bool result = true;
+    const char *path;
+    size_t i;
+    int ret;
+
+    if (!open_db())
+        return false;
+
+    t.visited = new_path_cache();
+
+    for (i = 0; i < nroots && result; ++i)
+        result = enqueue_root(&t, roots[i]);
+
+    while (result && t.queue_count > 0) {
+        sqlite3_bind_int64(refs_stmt, 1, t.queue[--t.queue_count]);
+
+        while ((ret = sqlite3_step(refs_stmt)) == SQLITE_ROW) {
+            path = (const char*)sqlite3_column_text(refs_stmt, 1);
+            if (path == NULL)
+                continue;
+            if (!enqueue(&t, sqlite3_column_int64(refs_stmt, 0), path)) {
+                result = false;
+                break;
+            }
+        }
+
+        if (result && ret != SQLITE_DONE) {
+            fprintf(stderr, "Unable to query references: %s\n",
+                    sqlite3_errmsg(db));
+            result = false;
+        }
+
+        sqlite3_reset(refs_stmt);
+    }
+
+    free(t.queue);
+    return result;
+}
@@ -0,0 +1,982 @@
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/fuse.h>
+
+#include "store-view.h"
+
+/* Store paths don't change while they exist, but they might be garbage
+   collected and built again, so the kernel revalidates entries and
+   attributes after a minute. A replaced file gets a new node on the next
+   lookup, which also drops the file contents cached for the old one. */
+#define CACHE_TIMEOUT 60
+
+/* The allowed store paths don't change, so neither do lookups of the other
+   ones. */
+#define NEGATIVE_TIMEOUT (24 * 60 * 60)
+
+/* The largest read request we allow, which is also the size of the reply
+   buffer. */
+#define MAX_PAGES 256
+
+struct node {
+    /* O_PATH descriptor of the file or -1 if the node is unused. */
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    uint64_t nlookup;
+    /* The next unused node if this one is unused as well. */
+    uint64_t next_free;
+};
+
+struct store_view {
+    /* The names of the allowed store paths, which are sorted once the
+       server starts, so that they can be looked up with bsearch(). */
+    char **names;
+    size_t count;
+    size_t alloc;
+
+    int store_fd;
+    int fuse_fd;
+
+    /* All the inodes the kernel knows about, indexed by node ID. */
+    struct node *nodes;
+    uint64_t nnodes;
+    uint64_t nalloc;
+    uint64_t free_node;
+
+    /* Open addressing hash table of the node IDs by device and inode, so
+       that repeated lookups of a file return the same node. */
+    uint64_t *index;
+    size_t index_size;
+    size_t indexed;
+
+    char *reply_buf;
+    size_t reply_size;
+};
+
+struct store_view *new_store_view(void)
+{
+    struct store_view *sv;
+
+    if ((sv = calloc(1, sizeof(struct store_view))) == NULL) {
+        perror("calloc store_view");
+        return NULL;
+    }
+
+    sv->store_fd = sv->fuse_fd = -1;
+    return sv;
+}
+
+bool is_store_view_path(const char *path)
+{
+    size_t storelen = sizeof NIX_STORE_DIR - 1;
+
+    return strncmp(path, NIX_STORE_DIR "/", storelen + 1) == 0
+        && path[storelen + 1] != '\0';
+}
+
+/* Allow access to the top-level store path that contains the given path.
+   Mounting only parts of a store path isn't possible with the store view,
+   but all of its references are part of the closure anyway. */
+bool allow_store_path(struct store_view *sv, const char *path)
+{
+    const char *name = path + sizeof NIX_STORE_DIR;
+    size_t len = strcspn(name, "/");
+    char *copy, **newnames;
+
+    if ((len == 1 && name[0] == '.') ||
+        (len == 2 && name[0] == '.' && name[1] == '.'))
+        return true;
+
+    // Paths of the same store path usually come in a row.
+    if (sv->count > 0 && strncmp(sv->names[sv->count - 1], name, len) == 0 &&
+        sv->names[sv->count - 1][len] == '\0')
+        return true;
+
+    if ((copy = strndup(name, len)) == NULL) {
+        perror("strndup store path");
+        return false;
+    }
+
+    if (sv->count == sv->alloc) {
+        sv->alloc = sv->alloc == 0 ? 256 : sv->alloc * 2;
+        if ((newnames = realloc(sv->names, sv->alloc * sizeof(char*))) == NULL) {
+            perror("realloc store view names");
+            free(copy);
+            return false;
+        }
+        sv->names = newnames;
+    }
+
+    sv->names[sv->count++] = copy;
+    return true;
+}
+
+static void reply(struct store_view *sv, uint64_t unique, int error,
+                  const void *data, size_t size)
+{
+    struct fuse_out_header out = {
+        .len = sizeof out + (error == 0 ? size : 0),
+        .error = -error,
+        .unique = unique,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &out, .iov_len = sizeof out },
+        { .iov_base = (void*)data, .iov_len = size },
+    };
+
+    // ENOENT means that the request has been interrupted in the meantime.
+    if (writev(sv->fuse_fd, iov, error == 0 && size > 0 ? 2 : 1) == -1 &&
+        errno != ENOENT)
+        perror("write store view reply");
+}
+
+static void fill_attr(struct fuse_attr *attr, const struct stat *st)
+{
+    memset(attr, 0, sizeof *attr);
+    attr->ino = st->st_ino;
+    attr->size = st->st_size;
+    attr->blocks = st->st_blocks;
+    attr->atime = st->st_atim.tv_sec;
+    attr->mtime = st->st_mtim.tv_sec;
+    attr->ctime = st->st_ctim.tv_sec;
+    attr->atimensec = st->st_atim.tv_nsec;
+    attr->mtimensec = st->st_mtim.tv_nsec;
+    attr->ctimensec = st->st_ctim.tv_nsec;
+    attr->mode = st->st_mode;
+    attr->nlink = st->st_nlink;
+    attr->uid = st->st_uid;
+    attr->gid = st->st_gid;
+    attr->rdev = st->st_rdev;
+    attr->blksize = st->st_blksize;
+}
+
+static struct node *get_node(struct store_view *sv, uint64_t id)
+{
+    if (id == 0 || id >= sv->nnodes || sv->nodes[id].fd == -1)
+        return NULL;
+
+    return &sv->nodes[id];
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool is_allowed(struct store_view *sv, const char *name)
+{
+    return bsearch(&name, sv->names, sv->count, sizeof(char*),
+                   name_cmp) != NULL;
+}
+
+/* Sort the allowed names and drop the duplicates. */
+static void sort_names(struct store_view *sv)
+{
+    size_t i, count = 0;
+
+    qsort(sv->names, sv->count, sizeof(char*), name_cmp);
+
+    for (i = 0; i < sv->count; ++i) {
+        if (count > 0 && strcmp(sv->names[count - 1], sv->names[i]) == 0)
+            free(sv->names[i]);
+        else
+            sv->names[count++] = sv->names[i];
+    }
+
+    sv->count = count;
+}
+
+static size_t hash_inode(dev_t dev, ino_t ino)
+{
+    uint64_t hash = (uint64_t)ino * 0x9e3779b97f4a7c15 ^ (uint64_t)dev;
+
+    return hash ^ (hash >> 32);
+}
+
+/* Returns the slot of the node for the given inode or the empty slot where
+   it belongs. */
+static size_t find_slot(struct store_view *sv, dev_t dev, ino_t ino)
+{
+    size_t mask = sv->index_size - 1, i = hash_inode(dev, ino) & mask;
+    struct node *node;
+
+    while (sv->index[i] != 0) {
+        node = &sv->nodes[sv->index[i]];
+        if (node->dev == dev && node->ino == ino)
+            break;
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+static uint64_t find_node(struct store_view *sv, const struct stat *st)
+{
+    if (sv->indexed == 0)
+        return 0;
+
+    return sv->index[find_slot(sv, st->st_dev, st->st_ino)];
+}
+
+static bool index_node(struct store_view *sv, uint64_t id)
+{
+    uint64_t *old = sv->index;
+    size_t i, oldsize = sv->index_size;
+
+    // Keep the load factor below one half.
+    if (2 * (sv->indexed + 1) > sv->index_size) {
+        sv->index_size = oldsize == 0 ? 1024 : oldsize * 2;
+
+        if ((sv->index = calloc(sv->index_size, sizeof(uint64_t))) == NULL) {
+            sv->index = old;
+            sv->index_size = oldsize;
+            return false;
+        }
+
+        for (i = 0; i < oldsize; ++i) {
+            if (old[i] != 0)
+                sv->index[find_slot(sv, sv->nodes[old[i]].dev,
+                                    sv->nodes[old[i]].ino)] = old[i];
+        }
+
+        free(old);
+    }
+
+    sv->index[find_slot(sv, sv->nodes[id].dev, sv->nodes[id].ino)] = id;
+    sv->indexed++;
+    return true;
+}
+
+/* Remove a node from the index and move the following ones of the same
+   cluster back, so that their probe sequences stay intact. */
+static void unindex_node(struct store_view *sv, uint64_t id)
+{
+    size_t mask = sv->index_size - 1, i, j, home;
+    struct node *node = &sv->nodes[id];
+
+    i = find_slot(sv, node->dev, node->ino);
+    if (sv->index[i] != id)
+        return;
+
+    for (j = (i + 1) & mask; sv->index[j] != 0; j = (j + 1) & mask) {
+        node = &sv->nodes[sv->index[j]];
+        home = hash_inode(node->dev, node->ino) & mask;
+
+        // Only move entries whose home slot isn't between i and j.
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && home <= i && home > j)) {
+            sv->index[i] = sv->index[j];
+            i = j;
+        }
+    }
+
+    sv->index[i] = 0;
+    sv->indexed--;
+}
+
+/* Returns the ID of a new node for the given descriptor or 0 on error. */
+static uint64_t new_node(struct store_view *sv, int fd, const struct stat *st)
+{
+    struct node *newnodes;
+    uint64_t id;
+
+    if (sv->free_node != 0) {
+        id = sv->free_node;
+        sv->free_node = sv->nodes[id].next_free;
+    } else {
+        if (sv->nnodes == sv->nalloc) {
+            sv->nalloc = sv->nalloc == 0 ? 1024 : sv->nalloc * 2;
+            newnodes = realloc(sv->nodes, sv->nalloc * sizeof(struct node));
+            if (newnodes == NULL)
+                return 0;
+            sv->nodes = newnodes;
+        }
+        id = sv->nnodes++;
+    }
+
+    sv->nodes[id].fd = fd;
+    sv->nodes[id].dev = st->st_dev;
+    sv->nodes[id].ino = st->st_ino;
+    sv->nodes[id].nlookup = 1;
+
+    if (!index_node(sv, id)) {
+        sv->nodes[id].fd = -1;
+        sv->nodes[id].next_free = sv->free_node;
+        sv->free_node = id;
+        return 0;
+    }
+
+    return id;
+}
+
+static void forget_node(struct store_view *sv, uint64_t id, uint64_t nlookup)
+{
+    struct node *node;
+
+    if (id == FUSE_ROOT_ID || (node = get_node(sv, id)) == NULL)
+        return;
+
+    if (node->nlookup > nlookup) {
+        node->nlookup -= nlookup;
+        return;
+    }
+
+    unindex_node(sv, id);
+    close(node->fd);
+    node->fd = -1;
+    node->next_free = sv->free_node;
+    sv->free_node = id;
+}
+
+static void do_init(struct store_view *sv, struct fuse_in_header *hdr,
+                    struct fuse_init_in *in)
+{
+    struct fuse_init_out out;
+
+    if (in->major != FUSE_KERNEL_VERSION) {
+        fprintf(stderr, "Unsupported FUSE protocol version %u.%u.\n",
+                in->major, in->minor);
+        reply(sv, hdr->unique, EPROTO, NULL, 0);
+        _exit(EXIT_FAILURE);
+    }
+
+    memset(&out, 0, sizeof out);
+    out.major = FUSE_KERNEL_VERSION;
+    out.minor = in->minor < FUSE_KERNEL_MINOR_VERSION
+              ? in->minor : FUSE_KERNEL_MINOR_VERSION;
+    out.max_readahead = in->max_readahead;
+    out.flags = in->flags & (FUSE_ASYNC_READ | FUSE_CACHE_SYMLINKS
+                             | FUSE_MAX_PAGES | FUSE_PARALLEL_DIROPS);
+    out.max_background = 16;
+    out.congestion_threshold = 12;
+    out.max_write = 4096;
+    out.time_gran = 1;
+    out.max_pages = MAX_PAGES;
+
+    reply(sv, hdr->unique, 0, &out,
+          out.minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof out);
+}
+
+/* The request handlers below reply on their own if they succeed, otherwise
+   they return the error, which is replied to by serve_store_view(). */
+static int do_lookup(struct store_view *sv, struct fuse_in_header *hdr,
+                     const char *name)
+{
+    struct fuse_entry_out out;
+    struct node *parent;
+    struct stat st;
+    int fd, err;
+
+    memset(&out, 0, sizeof out);
+
+    if ((parent = get_node(sv, hdr->nodeid)) == NULL)
+        return ESTALE;
+
+    if (hdr->nodeid == FUSE_ROOT_ID && !is_allowed(sv, name)) {
+        // A negative entry, so that the kernel caches the lookup as well.
+        out.entry_valid = NEGATIVE_TIMEOUT;
+        reply(sv, hdr->unique, 0, &out, sizeof out);
+        return 0;
+    }
+
+    if ((fd = openat(parent->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC)) == -1)
+        return errno;
+
+    if (fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+
+    // Every reply counts as a lookup, which the kernel forgets later.
+    if ((out.nodeid = find_node(sv, &st)) != 0) {
+        close(fd);
+        sv->nodes[out.nodeid].nlookup++;
+    } else if ((out.nodeid = new_node(sv, fd, &st)) == 0) {
+        close(fd);
+        return ENOMEM;
+    }
+
+    out.entry_valid = out.attr_valid = CACHE_TIMEOUT;
+    fill_attr(&out.attr, &st);
+    reply(sv, hdr->unique, 0, &out, sizeof out);
+    return 0;
+}
+
+static int do_getattr(struct store_view *sv, struct fuse_in_header *hdr)
+{
+    struct fuse_attr_out out;
+    struct node *node;
+    struct stat st;
+
+    if ((node = get_node(sv, hdr->nodeid)) == NULL)
+        return ESTALE;
+
+    if (fstatat(node->fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
+        return errno;
+
+    memset(&out, 0, sizeof out);
+    out.attr_valid = CACHE_TIMEOUT;
+    fill_attr(&out.attr, &st);
+    reply(sv, hdr->unique, 0, &out, sizeof out);
+    return 0;
+}
+
+static int do_readlink(struct store_view *sv, struct fuse_in_header *hdr)
+{
+    struct node *node;
+    ssize_t len;
+
+    if ((node = get_node(sv, hdr->nodeid)) == NULL)
+        return ESTALE;
+
+    len = readlinkat(node->fd, "", sv->reply_buf, sv->reply_size);
+    if (len == -1)
+        return errno;
+
+    reply(sv, hdr->unique, 0, sv->reply_buf, len);
+    return 0;
+}
+
+static int do_open(struct store_view *sv, struct fuse_in_header *hdr,
+                   struct fuse_open_in *in)
+{
+    struct fuse_open_out out;
+    char proc_path[64];
+    struct node *node;
+    int fd;
+
+    if ((node = get_node(sv, hdr->nodeid)) == NULL)
+        return ESTALE;
+
+    if ((in->flags & O_ACCMODE) != O_RDONLY)
+        return EROFS;
+
+    // Reopen the O_PATH descriptor for reading.
+    snprintf(proc_path, sizeof proc_path, "/proc/self/fd/%d", node->fd);
+
+    if ((fd = open(proc_path, O_RDONLY | O_CLOEXEC)) == -1)
+        return errno;
+
+    memset(&out, 0, sizeof out);
+    out.fh = fd;
+    out.open_flags = FOPEN_KEEP_CACHE;
+    reply(sv, hdr->unique, 0, &out, sizeof out);
+    return 0;
+}
+
+static int do_read(struct store_view *sv, struct fuse_in_header *hdr,
+                   struct fuse_read_in *in)
+{
+    size_t size = in->size < sv->reply_size ? in->size : sv->reply_size;
+    ssize_t len;
+
+    if ((len = pread(in->fh, sv->reply_buf, size, in->offset)) == -1)
+        return errno;
+
+    reply(sv, hdr->unique, 0, sv->reply_buf, len);
+    return 0;
+}
+
+/* The root directory is read from the list of allowed store paths, so its
+   file handle is 0 and all others are DIR pointers. */
+static int do_opendir(struct store_view *sv, struct fuse_in_header *hdr)
+{
+    struct fuse_open_out out;
+    struct node *node;
+    DIR *dir;
+    int fd;
+
+    if ((node = get_node(sv, hdr->nodeid)) == NULL)
+        return ESTALE;
+
+    memset(&out, 0, sizeof out);
+    out.open_flags = FOPEN_KEEP_CACHE | FOPEN_CACHE_DIR;
+
+    if (hdr->nodeid != FUSE_ROOT_ID) {
+        fd = openat(node->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            return errno;
+
+        if ((dir = fdopendir(fd)) == NULL) {
+            close(fd);
+            return ENOMEM;
+        }
+
+        out.fh = (uintptr_t)dir;
+    }
+
+    reply(sv, hdr->unique, 0, &out, sizeof out);
+    return 0;
+}
+
+/* Append a directory entry to the reply buffer and return its size or 0 if
+   it doesn't fit anymore. */
+static size_t add_dirent(char *buf, size_t pos, size_t size, uint64_t ino,
+                         uint64_t off, unsigned char type, const char *name)
+{
+    size_t namelen = strlen(name);
+    size_t entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+    struct fuse_dirent *dirent = (void*)(buf + pos);
+
+    if (pos + entlen > size)
+        return 0;
+
+    dirent->ino = ino;
+    dirent->off = off;
+    dirent->namelen = namelen;
+    dirent->type = type;
+    memcpy(dirent->name, name, namelen);
+    memset(dirent->name + namelen, 0, entlen - FUSE_NAME_OFFSET - namelen);
+    return entlen;
+}
+
+static int do_readdir(struct store_view *sv, struct fuse_in_header *hdr,
+                      struct fuse_read_in *in)
+{
+    size_t size = in->size < sv->reply_size ? in->size : sv->reply_size;
+    size_t pos = 0, len;
+    struct dirent *entry;
+    const char *name;
+    struct stat st;
+    uint64_t i;
+    DIR *dir;
+    long next;
+
+    if (in->fh != 0) {
+        dir = (DIR*)(uintptr_t)in->fh;
+
+        if (in->offset == 0)
+            rewinddir(dir);
+        else
+            seekdir(dir, in->offset);
+
+        while ((entry = readdir(dir)) != NULL) {
+            next = telldir(dir);
+            len = add_dirent(sv->reply_buf, pos, size, entry->d_ino, next,
+                             entry->d_type, entry->d_name);
+            if (len == 0)
+                break;
+            pos += len;
+        }
+
+        reply(sv, hdr->unique, 0, sv->reply_buf, pos);
+        return 0;
+    }
+
+    for (i = in->offset; i < sv->count + 2; ++i) {
+        name = i == 0 ? "." : i == 1 ? ".." : sv->names[i - 2];
+
+        if (fstatat(sv->store_fd, i < 2 ? "" : name, &st,
+                    AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+
+        len = add_dirent(sv->reply_buf, pos, size, st.st_ino, i + 1,
+                         IFTODT(st.st_mode), name);
+        if (len == 0)
+            break;
+        pos += len;
+    }
+
+    reply(sv, hdr->unique, 0, sv->reply_buf, pos);
+    return 0;
+}
+
+static int do_statfs(struct store_view *sv, struct fuse_in_header *hdr)
+{
+    struct fuse_statfs_out out;
+    struct statvfs st;
+
+    if (fstatvfs(sv->store_fd, &st) == -1)
+        return errno;
+
+    memset(&out, 0, sizeof out);
+    out.st.blocks = st.f_blocks;
+    out.st.bfree = st.f_bfree;
+    out.st.bavail = st.f_bavail;
+    out.st.files = st.f_files;
+    out.st.ffree = st.f_ffree;
+    out.st.bsize = st.f_bsize;
+    out.st.namelen = st.f_namemax;
+    out.st.frsize = st.f_frsize;
+    reply(sv, hdr->unique, 0, &out, sizeof out);
+    return 0;
+}
+
+static void do_batch_forget(struct store_view *sv,
+                            struct fuse_batch_forget_in *in)
+{
+    struct fuse_forget_one *forgets = (void*)(in + 1);
+    uint32_t i;
+
+    for (i = 0; i < in->count; ++i)
+        forget_node(sv, forgets[i].nodeid, forgets[i].nlookup);
+}
+
+static void serve_store_view(struct store_view *sv)
+{
+    char buf[FUSE_MIN_READ_BUFFER];
+    struct fuse_in_header *hdr = (void*)buf;
+    void *data = hdr + 1;
+    uint64_t fh;
+    ssize_t len;
+    int err;
+
+    for (;;) {
+        err = 0;
+
+        if ((len = read(sv->fuse_fd, buf, sizeof buf)) == -1) {
+            if (errno == EINTR || errno == ENOENT || errno == EAGAIN)
+                continue;
+            // The store view has been unmounted.
+            if (errno == ENODEV)
+                _exit(EXIT_SUCCESS);
+            perror("read store view request");
+            _exit(EXIT_FAILURE);
+        }
+
+        if ((size_t)len < sizeof *hdr)
+            continue;
+
+        switch (hdr->opcode) {
+            case FUSE_INIT:
+                do_init(sv, hdr, data);
+                break;
+            case FUSE_LOOKUP:
+                err = do_lookup(sv, hdr, data);
+                break;
+            case FUSE_FORGET:
+                forget_node(sv, hdr->nodeid,
+                            ((struct fuse_forget_in*)data)->nlookup);
+                break;
+            case FUSE_BATCH_FORGET:
+                do_batch_forget(sv, data);
+                break;
+            case FUSE_GETATTR:
+                err = do_getattr(sv, hdr);
+                break;
+            case FUSE_READLINK:
+                err = do_readlink(sv, hdr);
+                break;
+            case FUSE_OPEN:
+                err = do_open(sv, hdr, data);
+                break;
+            case FUSE_READ:
+                err = do_read(sv, hdr, data);
+                break;
+            case FUSE_RELEASE:
+                close(((struct fuse_release_in*)data)->fh);
+                reply(sv, hdr->unique, 0, NULL, 0);
+                break;
+            case FUSE_OPENDIR:
+                err = do_opendir(sv, hdr);
+                break;
+            case FUSE_READDIR:
+                err = do_readdir(sv, hdr, data);
+                break;
+            case FUSE_RELEASEDIR:
+                fh = ((struct fuse_release_in*)data)->fh;
+                if (fh != 0)
+                    closedir((DIR*)(uintptr_t)fh);
+                reply(sv, hdr->unique, 0, NULL, 0);
+                break;
+            case FUSE_STATFS:
+                err = do_statfs(sv, hdr);
+                break;
+            case FUSE_INTERRUPT:
+                // All requests are answered right away.
+                break;
+            case FUSE_DESTROY:
+                reply(sv, hdr->unique, 0, NULL, 0);
+                _exit(EXIT_SUCCESS);
+            default:
+                // The kernel doesn't ask again for most of these, eg. xattrs.
+                err = ENOSYS;
+                break;
+        }
+
+        if (err != 0)
+            reply(sv, hdr->unique, err, NULL, 0);
+    }
+}
+
+/* Receive the FUSE descriptor and the allowed store paths from the sandbox.
+   The paths are sent as one NUL-separated list, which ends when the sandbox
+   shuts down its end of the socket. */
+static bool receive_store_view(struct store_view *sv, int sock_fd)
+{
+    char cbuf[CMSG_SPACE(sizeof(int))], *buf = NULL, *newbuf, *name;
+    size_t len = 0, alloc = 0;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+
+    for (;;) {
+        if (alloc - len < PIPE_BUF) {
+            alloc = alloc == 0 ? 64 * 1024 : alloc * 2;
+            if ((newbuf = realloc(buf, alloc)) == NULL)
+                return false;
+            buf = newbuf;
+        }
+
+        iov.iov_base = buf + len;
+        iov.iov_len = alloc - len;
+
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        // Only the first message carries the descriptor.
+        if (sv->fuse_fd == -1) {
+            msg.msg_control = cbuf;
+            msg.msg_controllen = sizeof cbuf;
+        }
+
+        if ((n = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        if (sv->fuse_fd == -1) {
+            cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+                cmsg->cmsg_type != SCM_RIGHTS)
+                return false;
+            memcpy(&sv->fuse_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        if (n == 0)
+            break;
+
+        len += n;
+    }
+
+    if (len == 0 || buf[len - 1] != '\0')
+        return false;
+
+    // The names are sorted already, see start_store_view().
+    for (name = buf; name < buf + len; name += strlen(name) + 1) {
+        if (*name == '\0')
+            continue;
+
+        if (sv->count == sv->alloc) {
+            sv->alloc = sv->alloc == 0 ? 256 : sv->alloc * 2;
+            sv->names = realloc(sv->names, sv->alloc * sizeof(char*));
+            if (sv->names == NULL)
+                return false;
+        }
+
+        sv->names[sv->count++] = name;
+    }
+
+    return true;
+}
+
+/* Serve the store view once the sandbox has mounted it. Nothing is left
+   open but the FUSE descriptor and the store, in particular not the
+   terminal or pipes of the launch, otherwise eg. a command substitution
+   would never finish. */
+static void run_store_view(int sock_fd)
+{
+    struct store_view *sv;
+    struct rlimit limit;
+    int fd;
+
+    if ((fd = open("/dev/null", O_RDWR)) != -1) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+
+        if (fd > STDERR_FILENO)
+            close(fd);
+    }
+
+    if (sock_fd != STDERR_FILENO + 1) {
+        if (dup2(sock_fd, STDERR_FILENO + 1) == -1)
+            _exit(EXIT_FAILURE);
+        sock_fd = STDERR_FILENO + 1;
+    }
+
+#ifdef SYS_close_range
+    syscall(SYS_close_range, sock_fd + 1, ~0U, 0);
+#endif
+
+    if ((sv = new_store_view()) == NULL || !receive_store_view(sv, sock_fd))
+        _exit(EXIT_FAILURE);
+
+    close(sock_fd);
+
+    sv->store_fd = open(NIX_STORE_DIR, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (sv->store_fd == -1)
+        _exit(EXIT_FAILURE);
+
+    // Every inode the kernel knows about is an open descriptor.
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    sv->reply_size = MAX_PAGES * sysconf(_SC_PAGESIZE);
+
+    if ((sv->reply_buf = malloc(sv->reply_size)) == NULL)
+        _exit(EXIT_FAILURE);
+
+    // Node 0 is invalid and node 1 is the root directory.
+    sv->nalloc = 1024;
+
+    if ((sv->nodes = malloc(sv->nalloc * sizeof(struct node))) == NULL)
+        _exit(EXIT_FAILURE);
+
+    sv->nodes[0].fd = -1;
+    sv->nodes[FUSE_ROOT_ID].fd = sv->store_fd;
+    sv->nodes[FUSE_ROOT_ID].nlookup = 1;
+    sv->nnodes = FUSE_ROOT_ID + 1;
+
+    serve_store_view(sv);
+    _exit(EXIT_SUCCESS);
+}
+
+/* Fork the process serving the store view before any namespaces are created
+   and return the socket to hand it the store view once it's mounted.
+
+   The server runs outside of the sandbox, so that it can access the real
+   store. It's detached from the launch, otherwise it would be a child of
+   the program, which is PID 1 of its PID namespace and might wait for all
+   of its children. It exits when the store view is unmounted together with
+   the last mount namespace using it or if the sandbox fails before. */
+int fork_store_view(void)
+{
+    int sock[2], status;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sock) == -1) {
+        perror("socketpair store view");
+        return -1;
+    }
+
+    if ((pid = fork()) == -1) {
+        perror("fork store view");
+        close(sock[0]);
+        close(sock[1]);
+        return -1;
+    } else if (pid > 0) {
+        close(sock[1]);
+        waitpid(pid, &status, 0);
+        return sock[0];
+    }
+
+    close(sock[0]);
+
+    if (setsid() == -1 || fork() != 0)
+        _exit(EXIT_SUCCESS);
+
+    run_store_view(sock[1]);
+    _exit(EXIT_FAILURE);
+}
+
+/* Hand the mounted store view over to the server started by
+   fork_store_view(). The socket is closed in any case. */
+bool start_store_view(struct store_view *sv, int sock_fd, int fuse_fd)
+{
+    char cbuf[CMSG_SPACE(sizeof(int))], *buf, *pos, *end;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    bool result = false;
+    size_t i, len = 1;
+    ssize_t n;
+
+    sort_names(sv);
+
+    for (i = 0; i < sv->count; ++i)
+        len += strlen(sv->names[i]) + 1;
+
+    // The list starts with an empty name, so it's never empty itself.
+    if ((buf = malloc(len)) == NULL) {
+        perror("malloc store view names");
+        close(sock_fd);
+        return false;
+    }
+
+    buf[0] = '\0';
+
+    for (i = 0, pos = buf + 1; i < sv->count; ++i)
+        pos = stpcpy(pos, sv->names[i]) + 1;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    memset(&msg, 0, sizeof msg);
+    memset(cbuf, 0, sizeof cbuf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fuse_fd, sizeof(int));
+
+    if ((n = sendmsg(sock_fd, &msg, MSG_NOSIGNAL)) == -1) {
+        perror("send store view");
+        goto out;
+    }
+
+    for (pos = buf + n, end = buf + len; pos < end; pos += n) {
+        if ((n = send(sock_fd, pos, end - pos, MSG_NOSIGNAL)) == -1) {
+            perror("send store view paths");
+            goto out;
+        }
+    }
+
+    /* The socket is shared with the processes that forked us, eg. the
+       template daemon, so closing our descriptor doesn't end the list. */
+    if (shutdown(sock_fd, SHUT_WR) == -1) {
+        perror("shutdown store view socket");
+        goto out;
+    }
+
+    result = true;
+
+out:
+    free(buf);
+    close(sock_fd);
+    return result;
+}
+
+void free_store_view(struct store_view *sv)
+{
+    size_t i;
+
+    for (i = 0; i < sv->count; ++i)
+        free(sv->names[i]);
+
+    free(sv->names);
+    free(sv);
+}
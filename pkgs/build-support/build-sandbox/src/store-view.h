@@ -0,0 +1,19 @@
+#ifndef _STORE_VIEW_H
+#define _STORE_VIEW_H
+
+#include <stdbool.h>
+
+#ifndef NIX_STORE_DIR
+#define NIX_STORE_DIR "/nix/store"
+#endif
+
+struct store_view;
+
+struct store_view *new_store_view(void);
+bool is_store_view_path(const char *path);
+bool allow_store_path(struct store_view *sv, const char *path);
+int fork_store_view(void);
+bool start_store_view(struct store_view *sv, int sock_fd, int fuse_fd);
+void free_store_view(struct store_view *sv);
+
+#endif
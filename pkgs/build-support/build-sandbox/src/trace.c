@@ -0,0 +1,159 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_BUFSIZE 2048
+
+static bool trace_enabled = false;
+static int trace_fd = STDERR_FILENO;
+static pid_t trace_pid;
+static struct timespec trace_epoch;
+
+static struct {
+    uint64_t start;
+    uint64_t end;
+    bool done;
+} phases[TRACE_PHASES];
+
+static size_t counters[TRACE_COUNTERS];
+
+static const char *phase_names[TRACE_PHASES] = {
+    [TRACE_UNSHARE]       = "unshare",
+    [TRACE_WRITE_MAPS]    = "write_maps",
+    [TRACE_ROOTFS]        = "rootfs",
+    [TRACE_ETC_STATIC]    = "etc_static",
+    [TRACE_RUNTIME_PATHS] = "runtime_paths",
+    [TRACE_APP_PATHS]     = "app_paths",
+    [TRACE_RESOLVE]       = "resolve",
+    [TRACE_MOUNT_PLAN]    = "mount_plan",
+    [TRACE_STORE_VIEW]    = "store_view",
+    [TRACE_PROC]          = "proc",
+    [TRACE_CHROOT]        = "chroot",
+};
+
+static const char *counter_names[TRACE_COUNTERS] = {
+    [TRACE_MOUNTS]             = "mounts",
+    [TRACE_MKDIRS]             = "mkdirs",
+    [TRACE_SYMLINKS]           = "symlinks",
+    [TRACE_PATH_CACHE_HITS]    = "path_cache_hits",
+    [TRACE_CLOSURE_CACHE_HITS] = "closure_cache_hits",
+    [TRACE_CLOSURE_PATHS]      = "closure_paths",
+    [TRACE_BACKEND_LOADS]      = "backend_loads",
+    [TRACE_PLAN_ENTRIES]       = "plan_entries",
+    [TRACE_PLAN_SKIPPED]       = "plan_skipped",
+    [TRACE_STORE_PATHS]        = "store_paths",
+    [TRACE_WHOLE_STORE]        = "whole_store",
+};
+
+/* Microseconds since init_trace(), so that it's easy to compare launches
+   across machines. */
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - trace_epoch.tv_sec) * 1000000
+         + (ts.tv_nsec - trace_epoch.tv_nsec) / 1000;
+}
+
+/* Tracing is enabled by setting NIX_SANDBOX_TRACE to either "fd:N" to write
+   the trace to file descriptor N or to any other non-empty value except "0"
+   to write it to stderr. */
+bool init_trace(void)
+{
+    const char *value = getenv("NIX_SANDBOX_TRACE");
+    char *end;
+    long fd;
+
+    if (value == NULL || *value == '\0' || strcmp(value, "0") == 0)
+        return true;
+
+    if (strncmp(value, "fd:", 3) == 0) {
+        errno = 0;
+        fd = strtol(value + 3, &end, 10);
+        if (errno != 0 || *end != '\0' || end == value + 3 || fd < 0 ||
+            fd > INT32_MAX) {
+            fprintf(stderr, "Invalid NIX_SANDBOX_TRACE value '%s'.\n", value);
+            return false;
+        }
+        trace_fd = fd;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+    trace_pid = getpid();
+    trace_enabled = true;
+    return true;
+}
+
+void trace_begin(enum trace_phase phase)
+{
+    if (trace_enabled)
+        phases[phase].start = trace_now();
+}
+
+void trace_end(enum trace_phase phase)
+{
+    if (trace_enabled) {
+        phases[phase].end = trace_now();
+        phases[phase].done = true;
+    }
+}
+
+/* The runtime query counts from its own thread. */
+void trace_count(enum trace_counter counter, size_t n)
+{
+    if (trace_enabled)
+        __atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+#define APPEND(...) \
+    if (len < TRACE_BUFSIZE) \
+        len += snprintf(buf + len, TRACE_BUFSIZE - len, __VA_ARGS__)
+
+/* Write the whole trace as a single JSON line, so that traces of concurrent
+   launches don't get interleaved. Phases which didn't run are omitted. */
+void write_trace(void)
+{
+    char buf[TRACE_BUFSIZE];
+    size_t len = 0;
+    const char *sep = "";
+    int i;
+
+    if (!trace_enabled)
+        return;
+
+    APPEND("{\"pid\":%ld,\"total_us\":%llu,\"phases\":{",
+           (long)trace_pid, (unsigned long long)trace_now());
+
+    for (i = 0; i < TRACE_PHASES; ++i) {
+        if (!phases[i].done)
+            continue;
+        APPEND("%s\"%s\":[%llu,%llu]", sep, phase_names[i],
+               (unsigned long long)phases[i].start,
+               (unsigned long long)phases[i].end);
+        sep = ",";
+    }
+
+    APPEND("},\"counters\":{");
+
+    for (sep = "", i = 0; i < TRACE_COUNTERS; ++i) {
+        APPEND("%s\"%s\":%zu", sep, counter_names[i], counters[i]);
+        sep = ",";
+    }
+
+    APPEND("}}\n");
+
+    if (len >= TRACE_BUFSIZE) {
+        fputs("Trace is larger than the trace buffer.\n", stderr);
+        return;
+    }
+
+    if (write(trace_fd, buf, len) == -1)
+        fprintf(stderr, "write trace: %s\n", strerror(errno));
+}
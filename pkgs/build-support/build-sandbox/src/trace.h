@@ -0,0 +1,43 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum trace_phase {
+    TRACE_UNSHARE,
+    TRACE_WRITE_MAPS,
+    TRACE_ROOTFS,
+    TRACE_ETC_STATIC,
+    TRACE_RUNTIME_PATHS,
+    TRACE_APP_PATHS,
+    TRACE_RESOLVE,
+    TRACE_MOUNT_PLAN,
+    TRACE_STORE_VIEW,
+    TRACE_PROC,
+    TRACE_CHROOT,
+    TRACE_PHASES
+};
+
+enum trace_counter {
+    TRACE_MOUNTS,
+    TRACE_MKDIRS,
+    TRACE_SYMLINKS,
+    TRACE_PATH_CACHE_HITS,
+    TRACE_CLOSURE_CACHE_HITS,
+    TRACE_CLOSURE_PATHS,
+    TRACE_BACKEND_LOADS,
+    TRACE_PLAN_ENTRIES,
+    TRACE_PLAN_SKIPPED,
+    TRACE_STORE_PATHS,
+    TRACE_WHOLE_STORE,
+    TRACE_COUNTERS
+};
+
+bool init_trace(void);
+void trace_begin(enum trace_phase phase);
+void trace_end(enum trace_phase phase);
+void trace_count(enum trace_counter counter, size_t n);
+void write_trace(void);
+
+#endif